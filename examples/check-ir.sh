@@ -0,0 +1,33 @@
+#!/bin/sh
+# run each example through the direct emitter and through -fir, at each
+# optimization level, and report any program whose output differs.
+# usage: examples/check-ir.sh [minicc] [program.c ...]
+
+minicc=${1:-./minicc}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- "$(dirname "$0")"/*.c
+
+tmp=${TMPDIR:-/tmp}/check-ir.$$
+trap 'rm -f "$tmp".direct "$tmp".ir' EXIT
+failed=0
+
+for src in "$@"; do
+    # programs the direct emitter cannot run (e.g. host-only ones) are skipped
+    "$minicc" "$src" </dev/null >"$tmp".direct 2>&1
+    if ! tail -n 1 "$tmp".direct | grep -q '^exit('; then
+        echo "skip $src"
+        continue
+    fi
+    for opt in -O0 -O1 -O2; do
+        "$minicc" $opt "$src" </dev/null >"$tmp".direct 2>&1
+        "$minicc" -fir $opt "$src" </dev/null >"$tmp".ir 2>&1
+        if cmp -s "$tmp".direct "$tmp".ir; then
+            echo "ok   $src $opt"
+        else
+            echo "FAIL $src $opt"
+            diff "$tmp".direct "$tmp".ir | head -n 10
+            failed=1
+        fi
+    done
+done
+exit $failed
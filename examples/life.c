@@ -0,0 +1,111 @@
+#include <stdio.h>
+
+enum { Size = 16 };
+
+struct board {
+    int width;
+    int height;
+    int generation;
+    char *cells;
+};
+
+// the cell at `x`, `y`, wrapping around the edges
+int cell(struct board *b, int x, int y)
+{
+    x = (x + b->width) % b->width;
+    y = (y + b->height) % b->height;
+    return b->cells[y * b->width + x];
+}
+
+// compute the next generation of `b` into `next`, and return its population
+int step(struct board *b, char *next)
+{
+    int x, y, n, alive;
+
+    alive = 0;
+    y = 0;
+    while (y < b->height) {
+        x = 0;
+        while (x < b->width) {
+            n = cell(b, x - 1, y - 1) + cell(b, x, y - 1) +
+                cell(b, x + 1, y - 1) + cell(b, x - 1, y) +
+                cell(b, x + 1, y) + cell(b, x - 1, y + 1) +
+                cell(b, x, y + 1) + cell(b, x + 1, y + 1);
+            switch (n) {
+            case 2:
+                next[y * b->width + x] = b->cells[y * b->width + x];
+                break;
+            case 3:
+                next[y * b->width + x] = 1;
+                break;
+            default:
+                next[y * b->width + x] = 0;
+            }
+            alive = alive + next[y * b->width + x];
+            x++;
+        }
+        y++;
+    }
+    b->generation++;
+    return alive;
+}
+
+void show(struct board *b)
+{
+    int x, y;
+
+    printf("generation %d\n", b->generation);
+    y = 0;
+    while (y < b->height) {
+        x = 0;
+        while (x < b->width) {
+            printf("%c", b->cells[y * b->width + x] ? '#' : '.');
+            x++;
+        }
+        printf("\n");
+        y++;
+    }
+}
+
+int main()
+{
+    char front[256], back[256];
+    struct board b;
+    char *tmp;
+    int i, alive;
+
+    b.width = Size;
+    b.height = Size;
+    b.generation = 0;
+    b.cells = front;
+    i = 0;
+    while (i < Size * Size) {
+        front[i] = 0;
+        i++;
+    }
+
+    // a glider and a blinker
+    front[0 * Size + 1] = 1;
+    front[1 * Size + 2] = 1;
+    front[2 * Size + 0] = 1;
+    front[2 * Size + 1] = 1;
+    front[2 * Size + 2] = 1;
+    front[8 * Size + 10] = 1;
+    front[8 * Size + 11] = 1;
+    front[8 * Size + 12] = 1;
+    show(&b);
+
+    tmp = back;
+    i = 0;
+    while (i < 30) {
+        alive = step(&b, tmp);
+        tmp = b.cells;
+        b.cells = (b.cells == front) ? back : front;
+        if (b.generation % 10 == 0) {
+            printf("population %d\n", alive);
+        }
+        i++;
+    }
+    show(&b);
+    return 0;
+}
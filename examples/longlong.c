@@ -0,0 +1,104 @@
+#include <stdio.h>
+
+unsigned long long state;
+
+// print `v` in decimal
+void print_ull(unsigned long long v)
+{
+    if (v >= 10) {
+        print_ull(v / 10);
+    }
+    printf("%c", '0' + (int) (v % 10));
+}
+
+void print_ll(long long v)
+{
+    if (v < 0) {
+        printf("-");
+        print_ull(-(unsigned long long) v);
+    } else {
+        print_ull(v);
+    }
+}
+
+// print `v` in hex, as 16 digits
+void print_hex(unsigned long long v)
+{
+    printf("%08x%08x", (unsigned) (v >> 32), (unsigned) v);
+}
+
+// 64-bit FNV-1a hash of string `s`
+unsigned long long fnv1a(char *s)
+{
+    unsigned long long h;
+
+    h = 0xcbf29ce484222325;
+    while (*s) {
+        h = h ^ (unsigned char) *s++;
+        h = h * 0x100000001b3;
+    }
+    return h;
+}
+
+// Vigna's xorshift64*
+unsigned long long xorshift()
+{
+    state = state ^ (state >> 12);
+    state = state ^ (state << 25);
+    state = state ^ (state >> 27);
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+long long factorial(int n)
+{
+    long long f;
+
+    f = 1;
+    while (n > 1) {
+        f = f * n;
+        n--;
+    }
+    return f;
+}
+
+int main()
+{
+    long long a, b;
+    int i;
+
+    printf("fnv1a ");
+    print_hex(fnv1a("hello"));
+    printf(" ");
+    print_hex(fnv1a(""));
+    printf("\n");
+
+    state = 88172645463325252LL;
+    i = 0;
+    while (i < 3) {
+        printf("xorshift ");
+        print_ull(xorshift());
+        printf("\n");
+        i++;
+    }
+
+    printf("20! ");
+    print_ll(factorial(20));
+    printf("\n");
+
+    // signed and unsigned division, shifts and compares
+    a = -factorial(19);
+    b = 1000000007;
+    print_ll(a / b);
+    printf(" ");
+    print_ll(a % b);
+    printf(" ");
+    print_ll(a >> 20);
+    printf(" ");
+    print_ull((unsigned long long) a >> 20);
+    printf(" ");
+    print_ull((unsigned long long) a % b);
+    printf("\n");
+    printf("%d %d %d %d\n", a < b, (unsigned long long) a < b, a + 1 > a,
+           (1LL << 40) > 0x7fffffff);
+    return 0;
+}
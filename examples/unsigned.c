@@ -0,0 +1,90 @@
+#include <stdio.h>
+
+char *digits;
+unsigned state;
+
+// CRC-32 of the `n` bytes at `s`, a bit at a time
+unsigned crc32(unsigned char *s, int n)
+{
+    unsigned crc;
+    int k;
+
+    crc = ~0;
+    while (n > 0) {
+        crc = crc ^ *s;
+        k = 0;
+        while (k < 8) {
+            if (crc & 1) {
+                crc = (crc >> 1) ^ 0xEDB88320;
+            } else {
+                crc = crc >> 1;
+            }
+            k++;
+        }
+        s++;
+        n--;
+    }
+    return ~crc;
+}
+
+// Marsaglia's xorshift32
+unsigned xorshift()
+{
+    state = state ^ (state << 13);
+    state = state ^ (state >> 17);
+    state = state ^ (state << 5);
+    return state;
+}
+
+// print `v` in base `b`
+void print_base(unsigned v, unsigned b)
+{
+    if (v >= b) {
+        print_base(v / b, b);
+    }
+    printf("%c", digits[v % b]);
+}
+
+int main()
+{
+    unsigned u, max, one;
+    unsigned char uc;
+    long long d;
+    int i, k;
+
+    digits = "0123456789abcdef";
+    printf("crc32 %x\n", crc32((unsigned char *) "The quick brown fox "
+                               "jumps over the lazy dog", 43));
+
+    state = 2463534;
+    i = 0;
+    while (i < 4) {
+        printf("xorshift %u\n", xorshift());
+        i++;
+    }
+
+    max = ~0;
+    print_base(max, 10);
+    printf(" ");
+    print_base(max, 16);
+    printf(" ");
+    print_base(max / 3, 8);
+    printf(" %u %u\n", max % 1000, (max - 5) / 7);
+
+    // compares and shifts that differ from the signed ones
+    u = 0;
+    one = 1;
+    i = -1;
+    k = 5;
+    printf("%x %x\n", ~u >> 8, max >> 28);
+    printf("%d %d %d\n", ~u < k, -one > 0, i < 1);
+    u = i;
+    printf("%d %d %d %d\n", u > 1, u >= max, u / 2 > 1000, u % 10);
+
+    // an unsigned char is promoted to int before arithmetic
+    uc = 10;
+    d = uc - 20;
+    uc = 255;
+    printf("%d %d %d\n", (int) d, (int) (d >> 32), (unsigned char) (uc + 1));
+    return 0;
+}
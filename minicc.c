@@ -1,8 +1,42 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// exit statuses of a guest that the watchdog stopped
+enum {
+    StopTimeout = 124,  // as timeout(1)
+    StopBudget,
+};
+
+// hardware counters of --perf-counters, and the phases they are read for
+enum {
+    PerfCycles,
+    PerfInstructions,
+    PerfBranchMisses,
+    PerfCacheMisses,
+    PerfEvents,
+    Compile = 0,
+    Execute,
+};
 
 int token;                     // current token
 char *src, *old_src;           // pointer to source code string
@@ -11,24 +45,104 @@ int line;                      // line number
 int *text,                     // text segment
     *old_text,                 // for dump text segment
     *stack;                    // stack
-char *data;                    // data segment
-int *pc, *sp, *bp, ax, cycle;  // virtual machine registers
+unsigned char *code,           // code segment, text in compact encoding
+    *old_code;                 // start of code segment
+int *code_map;                 // address in code of each word of text
+int *lines;                    // source line of the statement that starts at
+                               // each word of text, 0 if none
+char *data,                    // data segment
+    *old_data,                 // start of data segment
+    *heap,                     // heap of the guest, what malloc() returns
+    *heap_end;
+int heap_size;                 // size of the heap
+int *co;                       // coroutines, in the heap
+int co_cur,                    // the running coroutine
+    co_head, co_tail;          // queue of coroutines ready to run
+int io_ep;                     // epoll instance of coroutines parked on I/O
+int io_parked;                 // number of them
+int io_epoch;                  // second of the monotonic clock now() counts from
+int threads;                   // host threads that run a parallel_for
+int parallel;                  // a parallel_for is running
+int pf_fn, pf_next, pf_hi,     // the function, next index and end of it
+    pf_chunk;                  // indices claimed at a time
+int pf_exited,                 // a call of it ended the program, e.g. by exit()
+    pf_status;                 // and the exit status it ended it with
+int pf_started;                // the threads of the pool are running
+int *pf_stacks;                // and their stacks
+int page_size;                 // of the host, for stack_overflow() to use
+pthread_barrier_t pf_start,    // where they wait for a parallel_for
+    pf_end;                    // and for each other at its end
+pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+int perf;                      // --perf-counters
+int lex_bench;                 // --lex-bench: only lex the source, timed
+int watchdog;                  // --max-instructions or --timeout is set
+long long budget = 0x7fffffffffffffffLL;  // instructions left to run
+int timeout;                   // --timeout, in ms
+volatile int expired;          // and it has passed
+int perf_fd[PerfEvents];       // the counters, -1 if not available
+int perf_error;                // errno of the first one that is not
+long long perf_count[2][PerfEvents + 1],  // of each phase, then its time
+    perf_start;                // when the phase started, in ns
 int token_val;                 // value of current token (mainly for number)
+int token_hi;                  // if it is a number, its high word
+int token_type;                // and its type
+unsigned char char_class[256]; // class bits of each character, for next()
+char *(*scan)(char *p, int class);  // skips a run of characters of a class
 int *current_id,               // current parsed ID
-    *symbols;                  // symbol table
+    *symbols,                  // symbol table
+    *sym_top,                  // and its free part
+    *buckets;                  // hash table of it, in its segment
 int *idmain;                   // the 'main' function
 int base_type;                 // the type of a declaration
 int expr_type;                 // the type of an expression
 int index_of_bp;               // index of bp pointer on stack
+int fun_type;                  // return type of the current function
+int locals;                    // local slots of the current function
+int addr_taken;                // the address of a local has been taken
+int opt_level;                 // -O<n>
+int inline_limit;              // size limit of inlined functions, in words
+int inline_report;             // report the inlined call sites
+int lazy;                      // compile functions on their first call
+int opt_ir;                    // -fir: optimize functions on the IR
+int *ir_arena, *ir_top;        // IR segment, and its free part
+int *ir, ir_count;             // nodes of the function being optimized
+int *blocks, block_count;      // and its basic blocks
+int *structs, struct_count;    // struct types, in their segment
+int *members;                  // free part of it, where their members go
+int *cache;                    // programs compiled by the workers of a server
+int cache_slots;               // number of programs in the cache
+int *last_cmp;                 // last comparison emitted, for fused branches
+int *last_ll;                  // last load of a local emitted
+int *last_field;               // last load of a struct member emitted
+int in_cond;                   // next expression() is a branch condition
+int *cond_true, *cond_false;   // pending jump chains of a branch condition
+int *breaks;                   // jump chain of the breaks of the innermost
+                               // switch or while, -1 outside of them
+int *cases, *case_top;         // value and address of each case label of the
+                               // switches being compiled, 0 outside of them
+int *case_default;             // the default label of the innermost one
 
 // instructions
 enum {
     LEA,
+    LL,
+    SL,
     IMM,
     JMP,
     CALL,
+    TAIL,
+    TARG,
+    LAZY,
+    FUN,
+    JTAB,
     JZ,
     JNZ,
+    JEQ,
+    JNE,
+    JLT,
+    JGT,
+    JLE,
+    JGE,
     ENT,
     ADJ,
     LEV,
@@ -36,6 +150,9 @@ enum {
     LC,
     SI,
     SC,
+    LIX,
+    SIX,
+    IDX,
     PUSH,
     OR,
     XOR,
@@ -53,6 +170,79 @@ enum {
     MUL,
     DIV,
     MOD,
+    ORI,
+    XORI,
+    ANDI,
+    EQI,
+    NEI,
+    LTI,
+    GTI,
+    LEI,
+    GEI,
+    SHLI,
+    SHRI,
+    ADDI,
+    SUBI,
+    MULI,
+    DIVI,
+    MODI,
+    DIVP,
+    MODP,
+    SHRUI,
+    LTU,
+    GTU,
+    LEU,
+    GEU,
+    SHRU,
+    DIVU,
+    MODU,
+    LIO,
+    LCO,
+    SIO,
+    SCO,
+    IMMH,
+    LCU,
+    LI64,
+    SI64,
+    PUSH64,
+    SX64,
+    ZX64,
+    SXS,
+    ZXS,
+    NZ64,
+    OR64,
+    XOR64,
+    AND64,
+    EQ64,
+    NE64,
+    LT64,
+    GT64,
+    LE64,
+    GE64,
+    SHL64,
+    SHR64,
+    ADD64,
+    SUB64,
+    MUL64,
+    DIV64,
+    MOD64,
+    LTU64,
+    GTU64,
+    LEU64,
+    GEU64,
+    SHRU64,
+    DIVU64,
+    MODU64,
+    JEQI,
+    JNEI,
+    JLTI,
+    JGTI,
+    JLEI,
+    JGEI,
+    WIDE,
+    TICK,
+    DONE,
+    STOP,
     OPEN,
     READ,
     CLOS,
@@ -60,6 +250,17 @@ enum {
     MALC,
     MSET,
     MCMP,
+    SNAP,
+    SPWN,
+    YLD,
+    JOIN,
+    WRIT,
+    PIPE,
+    FCTL,
+    EPCR,
+    EPCT,
+    EPWT,
+    PFOR,
     EXIT,
 };
 
@@ -79,6 +280,13 @@ enum {
     Return,
     Sizeof,
     While,
+    Break,
+    Case,
+    Default,
+    Switch,
+    Unsigned,
+    Struct,
+    Long,
     Assign,
     Cond,
     Lor,
@@ -102,6 +310,8 @@ enum {
     Inc,
     Dec,
     Brak,
+    Dot,
+    Arrow,
 };
 
 // fields of identifier
@@ -112,50 +322,346 @@ enum {
     Type,
     Class,
     Value,
+    Size,    // code size of a function, in words
+    Params,  // words of the parameters of a function
+    Wides,   // bit i set if its parameter i is a long long
+    Src,     // source of a function compiled on its first call
+    Line,    // and its line number
+    Code,    // and its code once it is compiled, 0 until then
+    Tag,     // the struct type it is the tag of, 0 if none
+    Array,   // number of elements of a local array, 0 if not one
+    Next,    // the identifier before it in its bucket, 0 if none
     BType,
     BClass,
     BValue,
     IdSize,
 };
 
-// types of variable and function
+// fields of the header of a snapshot image
+enum {
+    SMagic,
+    SBase,      // address of the memory of the virtual machine
+    SSize,      // size of it in the image
+    SOffset,    // offset of it in the image
+    SPool,      // pool_size
+    SHeapSize,  // heap_size
+    SPc,        // registers
+    SSp,
+    SBp,
+    SAx,
+    SText,      // ends of the segments
+    SSymbols,
+    SCode,
+    SData,
+    SHeap,
+    SOpt,       // options
+    SInline,
+    SLazy,
+    SIr,
+    SMain,      // the 'main' function
+    SCo,        // coroutines
+    SCoCur,
+    SCoHead,
+    SCoTail,
+    SHeader,
+};
+
+// fields of a coroutine
+enum {
+    CoPc,     // registers, while it is not running
+    CoSp,
+    CoBp,
+    CoAx,     // and its result once it has returned
+    CoState,
+    CoJoin,   // the coroutine waiting for it to return, -1 if none
+    CoNext,   // next in the ready queue
+    CoStack,  // its stack
+    CoFd,     // the file it is parked on
+    CoWake,   // when a parked wait times out, -1 never
+    CoSize,
+};
+
+// states of a coroutine, and how many there can be
+enum {
+    CoFree,
+    CoReady,  // or running
+    CoWait,   // in join()
+    CoDone,   // returned, not yet joined
+    CoIo,     // parked until a file is ready
+    CoMax = 256,
+    CoStackSize = 64 * 1024,
+};
+
+// bytes between the probes of a frame larger than that, no more than a page
+// so that the frame cannot step over the guard page below its stack
+enum {
+    StackProbe = 4096,
+};
+
+// fields of a cached program, followed by its source, code and data
+enum {
+    CSrc,     // size of the source
+    COpt,     // options it was compiled with
+    CInline,
+    CIr,
+    CCode,    // size of the code
+    CData,    // size of the data
+    CEntry,   // offset of the entry point in the code
+    CSlot,
+};
+
+// nodes of the IR of a function: its instructions, lifted out of text so
+// that jumps refer to the node they go to
+enum {
+    IrOp,      // opcode, -1 once removed
+    IrArg,     // operands that are not jump targets
+    IrArg2,
+    IrTarget,  // node jumped to, the node count for the end of the function
+    IrText,    // where it is in text
+    IrBlock,   // basic block it is in
+    IrAfter,   // chain of nodes inserted after it, 0 if none
+    IrBefore,  // and before it, where jumps to it land
+    IrPast,    // the jump lands past the nodes inserted before its target
+    IrLine,    // source line of the statement it starts, 0 if none
+    IrSize,
+};
+
+// basic blocks of the IR
+enum {
+    BFirst,  // first node
+    BEnd,    // node after the last
+    BNext,   // block fallen through to, -1 if none
+    BJump,   // block jumped to, -1 if none
+    BMark,   // for the passes
+    BSize,
+};
+
+// types of variable and function: STRUCT + i is the i-th struct type, and
+// each level of pointer adds PTR
 enum {
     CHAR,
     INT,
-    PTR,
+    UINT,
+    UCHAR,
+    LLONG,
+    ULLONG,
+    STRUCT,
+    PTR = 256,
+};
+
+// fields of a struct type, and of each of its members
+enum {
+    StBytes,    // size, 0 until it is defined
+    StAlign,
+    StMembers,  // its last member, 0 if none
+    StSize,
+    MemId = 0,  // identifier that names it
+    MemType,
+    MemOffset,
+    MemNext,    // the member before it, 0 if none
+    MemSize,
+};
+
+// buckets of the hash table of identifiers, a power of two
+enum {
+    Buckets = 1024,
+};
+
+// classes of characters in char_class
+enum {
+    ClassSpace = 1,  // blank or newline
+    ClassAlpha = 2,  // starts an identifier
+    ClassDigit = 4,
+    ClassIdent = ClassAlpha | ClassDigit,  // continues one
+    ClassLine = 8,   // anything but a newline or the end of the source
 };
 
+// skip the characters of `class` from `p`, counting the newlines, and return
+// where the run ends. the fallback of scan_sse2() and scan_avx2().
+char *scan_table(char *p, int class)
+{
+    while (char_class[*p & 255] & class) {
+        if (*p == '\n') {
+            ++line;
+        }
+        p++;
+    }
+    return p;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+// the same 16 bytes at a time. the loads are aligned, so that they never
+// reach into a page past the end of the source.
+__attribute__((target("sse2"))) char *scan_sse2(char *p, int class)
+{
+    char *a;
+    __m128i v, c;
+    unsigned in, nl, head;
+
+    a = (char *) ((int) p & -16);
+    head = (1u << (p - a)) - 1;  // the bytes before p
+    while (1) {
+        v = _mm_load_si128((__m128i *) a);
+        nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        if (class == ClassSpace) {
+            // ' ', or '\t' to '\r'
+            c = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                              _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+            c = _mm_or_si128(c, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        } else if (class == ClassIdent) {
+            // letters of either case, digits and '_'
+            c = _mm_or_si128(v, _mm_set1_epi8(0x20));
+            c = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+                              _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+            c = _mm_or_si128(
+                c, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                 _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))));
+            c = _mm_or_si128(c, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        } else {
+            // not a newline or the end
+            c = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                             _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+            c = _mm_xor_si128(c, _mm_set1_epi8(-1));
+        }
+        in = _mm_movemask_epi8(c) | head;
+        nl = nl & ~head;
+        if (in != 0xffff) {
+            nl = nl & ((1u << __builtin_ctz(~in)) - 1);
+            line = line + __builtin_popcount(nl);
+            return a + __builtin_ctz(~in);
+        }
+        line = line + __builtin_popcount(nl);
+        head = 0;
+        a = a + 16;
+    }
+}
+
+// and 32 bytes at a time
+__attribute__((target("avx2"))) char *scan_avx2(char *p, int class)
+{
+    char *a;
+    __m256i v, c;
+    unsigned in, nl, head;
+
+    a = (char *) ((int) p & -32);
+    head = (1u << (p - a)) - 1;
+    while (1) {
+        v = _mm256_load_si256((__m256i *) a);
+        nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        if (class == ClassSpace) {
+            c = _mm256_and_si256(
+                _mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v));
+            c = _mm256_or_si256(c,
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        } else if (class == ClassIdent) {
+            c = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+            c = _mm256_and_si256(
+                _mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+            c = _mm256_or_si256(
+                c, _mm256_and_si256(
+                       _mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                       _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v)));
+            c = _mm256_or_si256(c,
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+        } else {
+            c = _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+            c = _mm256_xor_si256(c, _mm256_set1_epi8(-1));
+        }
+        in = _mm256_movemask_epi8(c) | head;
+        nl = nl & ~head;
+        if (~in) {
+            nl = nl & ((1u << __builtin_ctz(~in)) - 1);
+            line = line + __builtin_popcount(nl);
+            return a + __builtin_ctz(~in);
+        }
+        line = line + __builtin_popcount(nl);
+        head = 0;
+        a = a + 32;
+    }
+}
+#endif
+
+// fill char_class, and pick the widest scan() that the host can run
+void init_lexer()
+{
+    int i;
+
+    memset(char_class, ClassLine, sizeof(char_class));
+    char_class[0] = 0;
+    char_class[' '] = ClassLine | ClassSpace;
+    for (i = '\t'; i <= '\r'; i++) {
+        char_class[i] = ClassLine | ClassSpace;
+    }
+    char_class['\n'] = ClassSpace;
+    for (i = 'a'; i <= 'z'; i++) {
+        char_class[i] = char_class[i - 'a' + 'A'] = ClassLine | ClassAlpha;
+    }
+    char_class['_'] = ClassLine | ClassAlpha;
+    for (i = '0'; i <= '9'; i++) {
+        char_class[i] = ClassLine | ClassDigit;
+    }
+
+    scan = scan_table;
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan = scan_sse2;
+    }
+#endif
+}
+
 void next()
 {
-    char *last_pos;
-    int hash;
+    char *last_pos, *p;
+    int hash, class;
+    int dec, uns, wide;      // of a number
+    unsigned long long num;  // its value
 
     while ((token = *src)) {
         ++src;
+        class = char_class[token & 255];
         // parse token here
-        if (token == '\n') {
-            ++line;
+        if (class & ClassSpace) {
+            // a short run inline, the rest of a long one with scan()
+            last_pos = src - 1;
+            if (token == '\n') {
+                ++line;
+            }
+            while (char_class[*src & 255] & ClassSpace) {
+                if (*src++ == '\n') {
+                    ++line;
+                }
+                if (src - last_pos == 8) {
+                    src = scan(src, ClassSpace);
+                }
+            }
         } else if (token == '#') {
             // skip macro, becausewe will not support it
-            while (*src != 0 && *src != '\n') {
-                ++src;
-            }
-        } else if ((token >= 'a' && token <= 'z') ||
-                   (token >= 'A' && token <= 'Z') || (token == '_')) {
-            // parse identifier
+            src = scan(src, ClassLine);
+        } else if (class & ClassAlpha) {
+            // parse identifier, the tail of a long one with scan()
             last_pos = src - 1;
             hash = token;
-
-            while ((*src >= 'a' && *src <= 'z') ||
-                   (*src >= 'A' && *src <= 'Z') ||
-                   (*src >= '0' && *src <= '9') || (*src == '_')) {
-                hash = hash * 147 + *src;
-                src++;
+            while (char_class[*src & 255] & ClassIdent) {
+                hash = hash * 147 + *src++;
+                if (src - last_pos == 8) {
+                    p = src;
+                    src = scan(src, ClassIdent);
+                    while (p < src) {
+                        hash = hash * 147 + *p++;
+                    }
+                }
             }
 
-            // look for existing identifier, linear search
-            current_id = symbols;
-            while (current_id[Token]) {
+            // look for existing identifier in its bucket
+            current_id = (int *) buckets[hash & (Buckets - 1)];
+            while (current_id) {
                 if (current_id[Hash] == hash &&
                     !memcmp((char *) current_id[Name], last_pos,
                             src - last_pos)) {
@@ -163,21 +669,26 @@ void next()
                     token = current_id[Token];
                     return;
                 }
-                current_id = current_id + IdSize;
+                current_id = (int *) current_id[Next];
             }
 
             // store new ID
+            current_id = sym_top;
+            sym_top = sym_top + IdSize;
             current_id[Name] = (int) last_pos;
             current_id[Hash] = hash;
+            current_id[Next] = buckets[hash & (Buckets - 1)];
+            buckets[hash & (Buckets - 1)] = (int) current_id;
             token = current_id[Token] = Id;
             return;
-        } else if (token >= '0' && token <= '9') {
+        } else if (class & ClassDigit) {
             // parse number, three kinds: dec(123), hex(0x123), oct(017)
-            token_val = token - '0';
-            if (token_val > 0) {
+            num = token - '0';
+            dec = num > 0;
+            if (dec) {
                 // dec, starts with [1-9]
                 while (*src >= '0' && *src <= '9') {
-                    token_val = token_val * 10 + *src++ - '0';
+                    num = num * 10 + *src++ - '0';
                 }
             } else {
                 // starts with number 0
@@ -187,17 +698,45 @@ void next()
                     while ((token >= '0' && token <= '9') ||
                            (token >= 'a' && token <= 'f') ||
                            (token >= 'A' && token <= 'F')) {
-                        token_val = token_val * 16 + (token & 15) +
-                                    (token >= 'A' ? 9 : 0);
+                        num = num * 16 + (token & 15) + (token >= 'A' ? 9 : 0);
                         token = *++src;
                     }
                 } else {
                     // oct
                     while (*src >= '0' && *src <= '7') {
-                        token_val = token_val * 8 + *src++ - '0';
+                        num = num * 8 + *src++ - '0';
                     }
                 }
             }
+            token_val = (int) num;
+            token_hi = (int) (num >> 32);
+
+            // suffixes, in either order: u for unsigned, l for long, which
+            // is an int, and ll for long long
+            uns = wide = 0;
+            while (*src == 'u' || *src == 'U' || *src == 'l' || *src == 'L') {
+                if (*src == 'u' || *src == 'U') {
+                    uns = 1;
+                    src++;
+                } else if (src[1] == *src) {
+                    wide = 1;
+                    src = src + 2;
+                } else {
+                    src++;
+                }
+            }
+
+            // as in C, the first of int, unsigned (but for a decimal without
+            // u), long long and unsigned long long that it fits
+            if (!uns && !wide && num <= 0x7fffffff) {
+                token_type = INT;
+            } else if (!wide && num <= 0xffffffff && (uns || !dec)) {
+                token_type = UINT;
+            } else if (!uns && num <= 0x7fffffffffffffffULL) {
+                token_type = LLONG;
+            } else {
+                token_type = ULLONG;
+            }
             token = Num;
             return;
         } else if (token == '"' || token == '\'') {
@@ -229,9 +768,7 @@ void next()
         } else if (token == '/') {
             if (*src == '/') {
                 // skip comments
-                while (*src != 0 && *src != '\n') {
-                    ++src;
-                }
+                src = scan(src, ClassLine);
             } else {
                 // divide operator
                 token = Div;
@@ -256,10 +793,13 @@ void next()
             }
             return;
         } else if (token == '-') {
-            // parse '-' and '--'
+            // parse '-', '--' and '->'
             if (*src == '-') {
                 ++src;
                 token = Dec;
+            } else if (*src == '>') {
+                ++src;
+                token = Arrow;
             } else {
                 token = Sub;
             }
@@ -325,6 +865,9 @@ void next()
         } else if (token == '[') {
             token = Brak;
             return;
+        } else if (token == '.') {
+            token = Dot;
+            return;
         } else if (token == '?') {
             token = Cond;
             return;
@@ -347,867 +890,3884 @@ void match(int tk)
     next();
 }
 
-void expression(int level)
+// is `type` a struct, rather than a pointer or a number
+int is_struct(int type)
 {
-    // expressions have various format.
-    // but majorly can be divided into two parts: unit and operator
-    // for example `(char) *a[10] = (int *) func(b > 0 ? 10 : 20);
-    // `a[10]` is an unit while `*` is an operator.
-    // `func(...)` in total is an unit.
-    // so we should first parse those unit and unary operators
-    // and then the binary ones
-    //
-    // also the expression can be in the following types:
-    //
-    // 1. unit_unary ::= unit | unit unary_op | unary_op unit
-    // 2. expr ::= unit_unary (bin_op unit_unary ...)
+    return type >= STRUCT && type < PTR;
+}
 
-    int *id;
-    int tmp;
-    int *addr;
+// is `type` a char, signed or not, stored in a byte
+int is_char(int type)
+{
+    return type == CHAR || type == UCHAR;
+}
 
-    // unit_unary()
-    {
-        if (token == Num) {
-            match(Num);
+// is `type` a long long, signed or not: two words, the low one first, and
+// in hx:ax as a value
+int is_wide(int type)
+{
+    return type == LLONG || type == ULLONG;
+}
 
-            // emit code
-            *++text = IMM;
-            *++text = token_val;
-            expr_type = INT;
-        } else if (token == '"') {  // string
-            // emit code;
-            *++text = IMM;
-            *++text = token_val;
+// size of a value of type `type`, in bytes, 0 for a struct not yet defined
+int type_size(int type)
+{
+    if (is_char(type)) {
+        return sizeof(char);
+    }
+    if (is_wide(type)) {
+        return 2 * sizeof(int);
+    }
+    if (is_struct(type)) {
+        return structs[(type - STRUCT) * StSize + StBytes];
+    }
+    return sizeof(int);
+}
 
-            match('"');
-            // store the rest strings
-            while (token == '"') {
-                match('"');
-            }
+// size of the frame slots or data words that a variable of type `type` takes
+int type_words(int type)
+{
+    if (!is_struct(type)) {
+        return is_wide(type) ? 2 : 1;
+    }
+    return (type_size(type) + sizeof(int) - 1) / sizeof(int);
+}
 
-            // append the end of string character '\0', all the data are default
-            // to 0, so just move data one position forward.
-            data = (char *) (((int) data + sizeof(int)) & (-sizeof(int)));
-            expr_type = PTR;
-        } else if (token == Sizeof) {
-            // sizeof is actually an unary operator
-            // now only `sizeof(int)`, `sizeof(char)` and `sizeof(int/char
-            // *...)` are supported.
+// what ++, -- and pointer arithmetic step a value of type `type` by
+int type_step(int type)
+{
+    return (type >= PTR) ? type_size(type - PTR) : 1;
+}
 
-            match(Sizeof);
-            match('(');
-            expr_type = INT;
+// the member named by identifier `id` of struct type `type`, 0 if none
+int *struct_member(int type, int *id)
+{
+    int *m;
 
-            if (token == Int) {
-                match(Int);
-            } else if (token == Char) {
-                expr_type = CHAR;
-                match(Char);
-            }
+    m = (int *) structs[(type - STRUCT) * StSize + StMembers];
+    while (m && (int *) m[MemId] != id) {
+        m = (int *) m[MemNext];
+    }
+    return m;
+}
+
+int type_specifier(int type);
+
+// parse `struct tag`, or `struct [tag] { members }` that lays the struct out
+// with each member aligned to its size, and return the struct type
+int struct_specifier()
+{
+    int type, base, mtype, align, offset, *st, *m;
+
+    match(Struct);
+    if (token != Id && token != '{') {
+        printf("%d: bad struct declaration\n", line);
+        exit(-1);
+    }
+    type = (token == Id) ? current_id[Tag] : 0;
+    if (!type) {  // first seen, defined here or later
+        if (STRUCT + struct_count >= PTR) {
+            printf("%d: too many struct types\n", line);
+            exit(-1);
+        }
+        type = STRUCT + struct_count++;
+    }
+    if (token == Id) {
+        current_id[Tag] = type;
+        match(Id);
+        if (token != '{') {
+            return type;
+        }
+    }
+    st = structs + (type - STRUCT) * StSize;
+    if (st[StBytes]) {
+        printf("%d: duplicate struct definition\n", line);
+        exit(-1);
+    }
 
+    match('{');
+    offset = 0;
+    st[StAlign] = 1;
+    while (token != '}') {
+        base = type_specifier(INT);
+        while (token != ';') {
+            mtype = base;
             while (token == Mul) {
-                expr_type = expr_type + PTR;
                 match(Mul);
+                mtype = mtype + PTR;
+            }
+            if (token != Id) {
+                printf("%d: bad member declaration\n", line);
+                exit(-1);
             }
+            if (struct_member(type, current_id)) {
+                printf("%d: duplicate member declaration\n", line);
+                exit(-1);
+            }
+            if (!type_size(mtype)) {
+                printf("%d: member of incomplete struct type\n", line);
+                exit(-1);
+            }
+            if ((char *) (members + MemSize) > (char *) structs + pool_size) {
+                printf("%d: too many struct members\n", line);
+                exit(-1);
+            }
+            align = is_char(mtype) ? 1 : sizeof(int);
+            if (is_struct(mtype)) {
+                align = structs[(mtype - STRUCT) * StSize + StAlign];
+            }
+            offset = (offset + align - 1) & -align;
+            st[StAlign] = (align > st[StAlign]) ? align : st[StAlign];
+
+            m = members;
+            members = members + MemSize;
+            m[MemId] = (int) current_id;
+            m[MemType] = mtype;
+            m[MemOffset] = offset;
+            m[MemNext] = st[StMembers];
+            st[StMembers] = (int) m;
+            offset = offset + type_size(mtype);
+            match(Id);
 
-            match(')');
+            if (token == ',') {
+                match(',');
+            }
+        }
+        match(';');
+    }
+    match('}');
+    if (!offset) {
+        printf("%d: empty struct\n", line);
+        exit(-1);
+    }
+    st[StBytes] = (offset + st[StAlign] - 1) & -st[StAlign];
+    return type;
+}
 
-            // emit code
-            *++text = IMM;
-            *++text = (expr_type == CHAR) ? sizeof(char) : sizeof(int);
+// parse `long [long] [int]`, unsigned if `uns`: a long is an int
+int long_specifier(int uns)
+{
+    int type;
 
-            expr_type = INT;
-        } else if (token == Id) {
-            // there are several type when occurs to Id
-            // but this is unit, so it can only be
-            // 1. function call
-            // 2. Enum variable
-            // 3. global/local variable
+    match(Long);
+    type = uns ? UINT : INT;
+    if (token == Long) {
+        match(Long);
+        type = uns ? ULLONG : LLONG;
+    }
+    if (token == Int) {
+        match(Int);
+    }
+    return type;
+}
 
-            match(Id);
-            id = current_id;
+// parse the type that a declaration, cast or sizeof starts with: char, int,
+// long, unsigned [int], unsigned char, [unsigned] long long or a struct,
+// `type` if there is none
+int type_specifier(int type)
+{
+    if (token == Struct) {
+        return struct_specifier();
+    }
+    if (token == Char) {
+        match(Char);
+        return CHAR;
+    }
+    if (token == Int) {
+        match(Int);
+        return INT;
+    }
+    if (token == Long) {
+        return long_specifier(0);
+    }
+    if (token == Unsigned) {
+        match(Unsigned);
+        if (token == Char) {
+            match(Char);
+            return UCHAR;
+        }
+        if (token == Long) {
+            return long_specifier(1);
+        }
+        if (token == Int) {
+            match(Int);
+        }
+        return UINT;
+    }
+    return type;
+}
 
-            if (token == '(') {  // function call
-                match('(');
+// print the name of identifier `id`
+void print_name(int *id)
+{
+    char *p;
 
-                // pass in arguments
-                tmp = 0;  // number of arguments
-                while (token != ')') {
-                    expression(Assign);
-                    *++text = PUSH;
-                    ++tmp;
+    p = (char *) id[Name];
+    while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+           (*p >= '0' && *p <= '9') || (*p == '_')) {
+        printf("%c", *p++);
+    }
+}
 
-                    if (token == ',') {
-                        match(',');
-                    }
-                }
-                match(')');
+// jumps whose target is not known yet are kept in a chain: the operand slot
+// of each jump holds the address of the previous one, 0 ends the chain.
+void patch(int *chain, int *target)
+{
+    int *prev;
 
-                // emit code
-                if (id[Class] == Sys) {  // system functions
-                    *++text = id[Value];
-                } else if (id[Class] == Fun) {  // function call
-                    *++text = CALL;
-                    *++text = id[Value];
-                } else {
-                    printf("%d: bad function call\n", line);
-                    exit(-1);
-                }
+    while (chain) {
+        prev = (int *) *chain;
+        *chain = (int) target;
+        chain = prev;
+    }
+}
 
-                // clean the stack for arguments
-                if (tmp > 0) {
-                    *++text = ADJ;
-                    *++text = tmp;
-                }
+// turn a value of type `type`, if it is a long long in hx:ax, into whether it
+// is not 0 in ax, for the tests that only look at ax
+void truth(int type)
+{
+    if (is_wide(type)) {
+        *++text = NZ64;
+    }
+}
 
-                expr_type = id[Type];
-            } else if (id[Class] == Num) {  // enum
-                *++text = IMM;
-                *++text = id[Value];
-                expr_type = INT;
-            } else {  // variable
-                if (id[Class] == Loc) {
-                    *++text = LEA;
-                    *++text = index_of_bp - id[Value];
-                } else if (id[Class] == Glo) {
-                    *++text = IMM;
-                    *++text = id[Value];
-                } else {
-                    printf("%d: undefined variable\n", line);
-                    exit(-1);
-                }
-                // emit code
-                // default behaviour is to load the value of the address which
-                // is stored in `ax`
-                expr_type = id[Type];
-                *++text = (expr_type == CHAR) ? LC : LI;
+// emit a jump taken when the value in `ax` is true (or false if `negate`),
+// linking it into `chain`. If the last instruction is a comparison, it is
+// fused with the test into a single compare-and-branch instruction.
+int *jump_if(int negate, int *chain)
+{
+    int op;
+
+    truth(expr_type);
+    op = 0;
+    if (last_cmp == text && *text >= EQ && *text <= GE) {
+        op = *text;
+    } else if (last_cmp == text - 1 && *last_cmp >= EQI && *last_cmp <= GEI) {
+        op = *last_cmp - EQI + EQ;  // immediate form, `<cmp>I imm`
+    }
+
+    if (op) {
+        if (negate) {
+            if (op == EQ || op == NE) {
+                op = (op == EQ) ? NE : EQ;
+            } else if (op == LT || op == GE) {
+                op = (op == LT) ? GE : LT;
+            } else {
+                op = (op == GT) ? LE : GT;
             }
-        } else if (token == '(') {  // cast or parenthesis
-            match('(');
+        }
+        if (last_cmp == text) {
+            *text = op - EQ + JEQ;
+        } else {
+            *last_cmp = op - EQ + JEQI;
+        }
+    } else {
+        *++text = negate ? JZ : JNZ;
+    }
+    *++text = (int) chain;
+    return text;
+}
 
-            if (token == Int || token == Char) {
-                tmp = (token == Char) ? CHAR : INT;  // cast type
-                match(token);
+// number of operands following opcode `op`
+int op_operands(int op)
+{
+    if (op >= JEQI && op <= JGEI) {
+        return 2;
+    }
+    if (op <= ADJ || (op >= ORI && op <= SHRUI) || (op >= LIO && op <= IMMH)) {
+        return 1;
+    }
+    return 0;
+}
 
-                while (token == Mul) {
-                    match(Mul);
-                    tmp = tmp + PTR;
-                }
+// index of the operand of `op` holding a jump target, -1 if none
+int op_target(int op)
+{
+    if (op == JMP || (op >= JZ && op <= JGE)) {
+        return 0;
+    }
+    if (op >= JEQI && op <= JGEI) {
+        return 1;
+    }
+    return -1;
+}
 
-                match(')');
-                expression(Inc);  // cast has precedence as Inc(++)
-                expr_type = tmp;
-            } else {  // normal parenthesis
-                expression(Assign);
-                match(')');
+// can calls to function `id` be replaced by a copy of its code: small
+// enough and a leaf, which also rules out recursion, and with no long long
+// parameters, its arguments are stored one word each.
+int inlinable(int *id)
+{
+    int *p, *end;
+
+    if (id[Class] != Fun || !id[Size] || id[Size] > inline_limit ||
+        id[Wides]) {
+        return 0;
+    }
+    p = (int *) id[Value];
+    end = p + id[Size];
+    while (p < end) {
+        if (*p == CALL || *p == TAIL) {
+            return 0;
+        }
+        p = p + 1 + op_operands(*p);
+    }
+    return 1;
+}
+
+// address that `old` of the code of function `id` gets when the code is
+// inlined at `to`: ENT and the final LEV are dropped, other LEVs become JMPs.
+int *inline_addr(int *id, int *old, int *to)
+{
+    int *p, *end;
+
+    end = (int *) id[Value] + id[Size];
+    p = (int *) id[Value] + 2;
+    while (p < old) {
+        if (*p == LEV) {
+            to = to + ((p + 1 < end) ? 2 : 0);
+        } else {
+            to = to + 1 + op_operands(*p);
+        }
+        p = p + 1 + op_operands(*p);
+    }
+    return to;
+}
+
+// copy the code of function `id` to the call site, its arguments have been
+// stored in local slots `base` + 1 ... of the caller, and its locals follow.
+void inline_code(int *id, int base)
+{
+    int *p, *to, *end, i, n;
+
+    to = text + 1;
+    end = (int *) id[Value] + id[Size];
+    n = id[Params];
+    p = (int *) id[Value] + 2;  // skip ENT
+    while (p < end) {
+        if (*p == LEV) {  // return, jump to the end of the copy
+            if (p + 1 < end) {
+                *++text = JMP;
+                *++text = (int) inline_addr(id, end, to);
             }
-        } else if (token == Mul) {  // dereference *<addr>
-            match(Mul);
-            expression(Inc);  // dereference has the same precedence as Inc(++)
+            p++;
+            continue;
+        }
 
-            if (expr_type >= PTR) {
-                expr_type = expr_type - PTR;
-            } else {
-                printf("%d: bad dereference\n", line);
-                exit(-1);
+        *++text = *p;
+        i = 0;
+        while (i < op_operands(*p)) {
+            *++text = p[i + 1];
+            if (*p == LEA || *p == LL || *p == SL) {
+                // parameters are above bp, locals below
+                *text = (*text > 1) ? *text - base - n - 2 : *text - base - n;
+            } else if (i == op_target(*p)) {
+                *text = (int) inline_addr(id, (int *) *text, to);
             }
+            i++;
+        }
+        p = p + 1 + op_operands(*p);
+    }
+}
 
-            *++text = (expr_type == CHAR) ? LC : LI;
-        } else if (token == And) {  // get the address of
-            match(And);
-            expression(Inc);
+// k if n is 1 << k, -1 otherwise
+int log2_of(int n)
+{
+    int k;
 
-            if (*text == LC || *text == LI) {
-                text--;
-            } else {
-                printf("%d: bad address\n", line);
-                exit(-1);
-            }
+    k = 0;
+    while (n > 1 && !(n & 1)) {
+        n = n >> 1;
+        k++;
+    }
+    return (n == 1) ? k : -1;
+}
 
-            expr_type = expr_type + PTR;
-        } else if (token == '!') {  // not
-            match('!');
-            expression(Inc);
+// operator `op` on operands of types `a` and `b`, in its unsigned form if
+// either of them is unsigned
+int sign_op(int op, int a, int b)
+{
+    if (a != UINT && b != UINT) {
+        return op;
+    }
+    return (op == LT)    ? LTU
+           : (op == GT)  ? GTU
+           : (op == LE)  ? LEU
+           : (op == GE)  ? GEU
+           : (op == SHR) ? SHRU
+           : (op == DIV) ? DIVU
+           : (op == MOD) ? MODU
+                         : op;
+}
 
-            // emit code, use <expr> == 0
-            *++text = PUSH;
-            *++text = IMM;
-            *++text = 0;
-            *++text = EQ;
+// the type of arithmetic on operands of types `a` and `b`, after the integer
+// promotions: the wider of them, unsigned if either of them is, int otherwise
+int arith_type(int a, int b)
+{
+    if (a >= PTR) {
+        return a;
+    }
+    if (a == ULLONG || b == ULLONG) {
+        return ULLONG;
+    }
+    if (a == LLONG || b == LLONG) {
+        return LLONG;
+    }
+    return (a == UINT || b == UINT) ? UINT : INT;
+}
 
-            expr_type = INT;
-        } else if (token == '~') {  // bitwise not
-            match('~');
-            expression(Inc);
+// the type that unary operators and shifts give an operand of type `type`:
+// an unsigned or long long one keeps it, others are ints
+int promote(int type)
+{
+    return (type == UINT || is_wide(type)) ? type : INT;
+}
 
-            // emit code, use <expr> ^ 0xFFFF(-1)
-            *++text = PUSH;
-            *++text = IMM;
-            *++text = -1;
-            *++text = XOR;
+// extend the value of type `type` in ax, or on the stack if `pushed`, to a
+// long long: with zeros if it is unsigned or a pointer, with its sign if not.
+// a long long stays.
+void widen(int type, int pushed)
+{
+    if (is_wide(type)) {
+        return;
+    }
+    if (type == UINT || type == UCHAR || type >= PTR) {
+        *++text = pushed ? ZXS : ZX64;
+    } else {
+        *++text = pushed ? SXS : SX64;
+    }
+}
 
-            expr_type = INT;
-        } else if (token == Add) {  // +var, do nothing
-            match(Add);
-            expression(Inc);
+// emit the long long form of binary operator `op` for `<lhs> PUSH <rhs>` on
+// operands of types `a` and `b`, if either of them is a long long and `a` is
+// not a pointer: the other one is widened, but for a shift count. 0 if it is
+// not one, for binary() to emit.
+int binary_wide(int op, int a, int b)
+{
+    int shift;
 
-            expr_type = INT;
-        } else if (token == Sub) {  // -var
-            match(Sub);
+    shift = op == SHL || op == SHR;
+    if (a >= PTR || !(is_wide(a) || (is_wide(b) && !shift))) {
+        return 0;
+    }
+    if (!shift) {
+        widen(a, 1);
+        widen(b, 0);
+    }
+    if (a == ULLONG || (b == ULLONG && !shift)) {
+        op = sign_op(op, UINT, UINT);
+    }
+    *++text = (op >= LTU) ? op - LTU + LTU64 : op - OR + OR64;
+    return 1;
+}
 
-            if (token == Num) {
-                *++text = IMM;
-                *++text = -token_val;
-                match(Num);
-            } else {  // -x == -1 * x
-                expression(Inc);
-                *++text = PUSH;
-                *++text = IMM;
-                *++text = -1;
-                *++text = MUL;
-            }
+// emit `PUSH64 IMM n SX64 <op>64` for the long long in hx:ax
+void wide_imm(int op, int n)
+{
+    *++text = PUSH64;
+    *++text = IMM;
+    *++text = n;
+    *++text = SX64;
+    *++text = op - OR + OR64;
+}
 
-            expr_type = INT;
-        } else if (token == Inc || token == Dec) {
-            tmp = token;
-            match(token);
-            expression(Inc);
+// emit binary operator `op` for `<lhs> PUSH <rhs>`, where `lhs` is the start
+// of the left operand's code and `push` its PUSH. Constant operands are folded
+// and a constant right operand uses the immediate form `<op>I`, so `i + 1` is
+// `<i> ADDI 1` instead of `<i> PUSH IMM 1 ADD`.
+void binary(int op, int *lhs, int *push)
+{
+    int a, b;
+
+    if (text == push + 2 && push[1] == IMM) {
+        b = push[2];
+        if (push == lhs + 2 && *lhs == IMM &&
+            !((op == DIV || op == MOD || op == DIVU || op == MODU) &&
+              (b == 0 || b == -1))) {
+            // both are constants, fold them
+            a = lhs[1];
+            if (op == OR) {
+                a = a | b;
+            } else if (op == XOR) {
+                a = a ^ b;
+            } else if (op == AND) {
+                a = a & b;
+            } else if (op == EQ) {
+                a = a == b;
+            } else if (op == NE) {
+                a = a != b;
+            } else if (op == LT) {
+                a = a < b;
+            } else if (op == GT) {
+                a = a > b;
+            } else if (op == LE) {
+                a = a <= b;
+            } else if (op == GE) {
+                a = a >= b;
+            } else if (op == SHL) {
+                a = a << b;
+            } else if (op == SHR) {
+                a = a >> b;
+            } else if (op == ADD) {
+                a = a + b;
+            } else if (op == SUB) {
+                a = a - b;
+            } else if (op == MUL) {
+                a = a * b;
+            } else if (op == DIV) {
+                a = a / b;
+            } else if (op == MOD) {
+                a = a % b;
+            } else if (op == LTU) {
+                a = (unsigned) a < (unsigned) b;
+            } else if (op == GTU) {
+                a = (unsigned) a > (unsigned) b;
+            } else if (op == LEU) {
+                a = (unsigned) a <= (unsigned) b;
+            } else if (op == GEU) {
+                a = (unsigned) a >= (unsigned) b;
+            } else if (op == SHRU) {
+                a = (unsigned) a >> b;
+            } else if (op == DIVU) {
+                a = (unsigned) a / (unsigned) b;
+            } else {
+                a = (unsigned) a % (unsigned) b;
+            }
+            text = lhs + 1;
+            *text = a;
+            return;
+        }
 
-            if (*text == LC) {
-                *text = PUSH;  // to duplicate the address
-                *++text = LC;
-            } else if (*text == LI) {
-                *text = PUSH;
-                *++text = LI;
+        // unsigned operators have no immediate form, but a shift or a mask
+        // does for division and modulo by powers of two
+        if (op >= LTU && op <= MODU) {
+            if (op == SHRU || ((op == DIVU || op == MODU) && log2_of(b) > 0)) {
+                text = push - 1;
+                *++text = (op == MODU) ? ANDI : SHRUI;
+                *++text = (op == SHRU) ? b : (op == DIVU) ? log2_of(b) : b - 1;
             } else {
-                printf("%d: bad lvalue of pre-increment\n", line);
-                exit(-1);
+                *++text = op;
             }
+            return;
+        }
 
-            *++text = PUSH;
-            *++text = IMM;
-            *++text = (expr_type > PTR) ? sizeof(int) : sizeof(char);
-            *++text = (tmp == Inc) ? ADD : SUB;
-            *++text = (expr_type == CHAR) ? SC : SI;
+        // strength reduction for powers of two, division and modulo are
+        // signed so they need DIVP/MODP rather than a plain shift or mask
+        text = push - 1;  // drop `PUSH IMM b`
+        if ((op == MUL || op == DIV || op == MOD) && log2_of(b) > 0) {
+            *++text = (op == MUL) ? SHLI : (op == DIV) ? DIVP : MODP;
+            b = log2_of(b);
         } else {
-            printf("%d: bad expression\n", line);
-            exit(-1);
+            *++text = op - OR + ORI;
+        }
+        *++text = b;
+        if (op >= EQ && op <= GE) {
+            last_cmp = text - 1;
         }
+        return;
     }
 
-    // binary operator and postfix operators.
-    {
-        while (token >= level) {
-            // handle according to current operator's precedence
-            tmp = expr_type;
+    *++text = op;
+    if (op >= EQ && op <= GE) {
+        last_cmp = text;
+    }
+}
 
-            if (token == Assign) {
-                // var = expr;
-                match(Assign);
-                if (*text == LC || *text == LI) {
-                    *text = PUSH;  // save the lvalue's address
-                } else {
-                    printf("%d: bad lvalue in assignment\n", line);
-                    exit(-1);
-                }
-                expression(Assign);
+// emit `PUSH; IMM n; <op>` for the value in `ax` whose code starts at `lhs`.
+void binary_imm(int op, int n, int *lhs)
+{
+    int *push;
 
-                expr_type = tmp;
-                *++text = (expr_type == CHAR) ? SC : SI;
-            } else if (token == Cond) {
-                // expr ? a : b;
-                match(Cond);
-                *++text = JZ;
-                addr = ++text;
-                expression(Assign);
+    *++text = PUSH;
+    push = text;
+    *++text = IMM;
+    *++text = n;
+    binary(op, lhs, push);
+}
 
-                if (token == ':') {
-                    match(':');
-                } else {
-                    printf("%d: missing colon in conditional\n", line);
-                    exit(-1);
-                }
+// turn the pending jump chains of a branch condition back into a value in
+// `ax`, for the rare conditions that need it, e.g. `if (a && b ? x : y)`.
+void cond_value()
+{
+    int *done;
 
-                *addr = (int) (text + 3);
-                *++text = JMP;
-                addr = ++text;
-                expression(Cond);
-                *addr = (int) (text + 1);
-            } else if (token == Lor) {
-                // logic or
-                match(Lor);
-                *++text = JNZ;
-                addr = ++text;
-                expression(Lan);
-                *addr = (int) (text + 1);
-                expr_type = INT;
-            } else if (token == Lan) {
-                // logic and
-                match(Lan);
-                *++text = JZ;
-                addr = ++text;
-                expression(Or);
-                *addr = (int) (text + 1);
-                expr_type = INT;
-            } else if (token == Or) {
-                // bitwise or
-                match(Or);
-                *++text = PUSH;
-                expression(Xor);
-                *++text = OR;
-                expr_type = INT;
-            } else if (token == Xor) {
-                // bitwise xor
-                match(Xor);
-                *++text = PUSH;
-                expression(And);
-                *++text = XOR;
-                expr_type = INT;
-            } else if (token == And) {
-                // bitwise and
-                match(And);
-                *++text = PUSH;
-                expression(Eq);
-                *++text = AND;
-                expr_type = INT;
-            } else if (token == Eq) {
-                // equal ==
-                match(Eq);
-                *++text = PUSH;
-                expression(Ne);
-                *++text = EQ;
-                expr_type = INT;
-            } else if (token == Ne) {
-                // not equal !=
-                match(Ne);
-                *++text = PUSH;
-                expression(Lt);
-                *++text = NE;
-                expr_type = INT;
-            } else if (token == Lt) {
-                // less than <
-                match(Lt);
-                *++text = PUSH;
-                expression(Shl);
-                *++text = LT;
-                expr_type = INT;
-            } else if (token == Gt) {
-                // greater than >
-                match(Gt);
-                *++text = PUSH;
-                expression(Shl);
-                *++text = GT;
-                expr_type = INT;
-            } else if (token == Le) {
-                // less than or equal to <=
-                match(Le);
-                *++text = PUSH;
-                expression(Shl);
-                *++text = LE;
-                expr_type = INT;
-            } else if (token == Ge) {
-                // greater than or equal to >=
-                match(Ge);
-                *++text = PUSH;
-                expression(Shl);
-                *++text = GE;
-                expr_type = INT;
-            } else if (token == Shl) {
-                // shift left
-                match(Shl);
-                *++text = PUSH;
-                expression(Add);
-                *++text = SHL;
-                expr_type = INT;
-            } else if (token == Shr) {
-                // shift right
-                match(Shr);
-                *++text = PUSH;
-                expression(Add);
-                *++text = SHR;
-                expr_type = INT;
-            } else if (token == Add) {
-                // add
-                match(Add);
-                *++text = PUSH;
-                expression(Mul);
+    if (cond_true || cond_false) {
+        *++text = JMP;
+        *++text = 0;
+        done = text;
+        patch(cond_true, text + 1);
+        *++text = IMM;
+        *++text = 1;
+        *++text = JMP;
+        *++text = (int) done;
+        done = text;
+        patch(cond_false, text + 1);
+        *++text = IMM;
+        *++text = 0;
+        patch(done, text + 1);
+        cond_true = cond_false = 0;
+    }
+}
 
-                expr_type = tmp;
-                if (expr_type > PTR) {
-                    // pointer type, and not `char *`
+// load the value of type `type` at the address in ax, a struct stays its
+// address
+void load(int type)
+{
+    if (is_wide(type)) {
+        *++text = LI64;
+    } else if (!is_struct(type)) {
+        *++text = (type == CHAR) ? LC : (type == UCHAR) ? LCU : LI;
+    }
+}
+
+// store the value of type `type` in ax at the address on the stack
+void store(int type)
+{
+    *++text = is_char(type) ? SC : is_wide(type) ? SI64 : SI;
+}
+
+// load the member at `offset` of type `type` of the struct whose address is
+// in ax, computed by the code from `lhs` on. A global's or a local's member
+// is at a constant address, others are loaded with LIO/LCO at the offset.
+void member_load(int offset, int type, int *lhs)
+{
+    if (lhs == text - 1 && (*lhs == IMM || (*lhs == LEA &&
+                                            offset % sizeof(int) == 0))) {
+        *text = *text + ((*lhs == IMM) ? offset : offset / (int) sizeof(int));
+        load(type);
+    } else if (is_struct(type)) {
+        binary_imm(ADD, offset, lhs);
+    } else if (offset == 0) {
+        load(type);
+    } else if (type == UCHAR || is_wide(type)) {  // no offset form
+        binary_imm(ADD, offset, lhs);
+        load(type);
+    } else {
+        *++text = (type == CHAR) ? LCO : LIO;
+        *++text = offset;
+        last_field = text - 1;
+    }
+}
+
+// turn a member load `LIO offset` back into `ADDI offset LI`, for the
+// operators that need the member's address
+void member_address(int *lhs)
+{
+    int op, offset;
+
+    if (last_field == text - 1 && (*last_field == LIO || *last_field == LCO)) {
+        op = *last_field;
+        offset = *text;
+        text = text - 2;
+        binary_imm(ADD, offset, lhs);
+        *++text = (op == LCO) ? LC : LI;
+    }
+}
+
+void expression(int level)
+{
+    // expressions have various format.
+    // but majorly can be divided into two parts: unit and operator
+    // for example `(char) *a[10] = (int *) func(b > 0 ? 10 : 20);
+    // `a[10]` is an unit while `*` is an operator.
+    // `func(...)` in total is an unit.
+    // so we should first parse those unit and unary operators
+    // and then the binary ones
+    //
+    // also the expression can be in the following types:
+    //
+    // 1. unit_unary ::= unit | unit unary_op | unary_op unit
+    // 2. expr ::= unit_unary (bin_op unit_unary ...)
+
+    int *id;
+    int tmp;
+    int *addr;
+    int *lhs;  // start of the code of the left operand
+    int cond;  // our value is only used to branch, see condition()
+    int base;  // local slots of an inlined call
+    int slot;  // frame slot of a local
+    int words; // pushed for the arguments of a call
+
+    lhs = text + 1;
+    cond = in_cond;
+    in_cond = 0;
+
+    // unit_unary()
+    {
+        if (token == Num) {
+            expr_type = token_type;
+            match(Num);
+
+            // emit code
+            *++text = IMM;
+            *++text = token_val;
+            if (is_wide(expr_type)) {
+                *++text = IMMH;
+                *++text = token_hi;
+            }
+        } else if (token == '"') {  // string
+            // emit code;
+            *++text = IMM;
+            *++text = token_val;
+
+            match('"');
+            // store the rest strings
+            while (token == '"') {
+                match('"');
+            }
+
+            // append the end of string character '\0', all the data are default
+            // to 0, so just move data one position forward.
+            data = (char *) (((int) data + sizeof(int)) & (-sizeof(int)));
+            expr_type = PTR;
+        } else if (token == Sizeof) {
+            // sizeof is actually an unary operator
+            // now only `sizeof(int)`, `sizeof(char)` and `sizeof(int/char
+            // *...)` are supported.
+
+            match(Sizeof);
+            match('(');
+            expr_type = type_specifier(INT);
+
+            while (token == Mul) {
+                expr_type = expr_type + PTR;
+                match(Mul);
+            }
+
+            match(')');
+            if (!type_size(expr_type)) {
+                printf("%d: sizeof incomplete struct type\n", line);
+                exit(-1);
+            }
+
+            // emit code
+            *++text = IMM;
+            *++text = type_size(expr_type);
+
+            expr_type = INT;
+        } else if (token == Id) {
+            // there are several type when occurs to Id
+            // but this is unit, so it can only be
+            // 1. function call
+            // 2. Enum variable
+            // 3. global/local variable
+
+            match(Id);
+            id = current_id;
+
+            if (token == '(' && opt_level >= 2 && inlinable(id)) {
+                // inline expansion, the arguments are stored to fresh
+                // local slots instead of being pushed
+                match('(');
+                base = locals;
+                locals = locals + id[Params] + ((int *) id[Value])[1];
+
+                tmp = 0;  // number of arguments
+                while (token != ')') {
+                    *++text = LEA;
+                    *++text = -(base + 1 + tmp);
                     *++text = PUSH;
-                    *++text = IMM;
-                    *++text = sizeof(int);
-                    *++text = MUL;
+                    expression(Assign);
+                    *++text = SI;
+                    ++tmp;
+
+                    if (token == ',') {
+                        match(',');
+                    }
                 }
-                *++text = ADD;
-            } else if (token == Sub) {
-                // sub
-                match(Sub);
-                *++text = PUSH;
-                expression(Mul);
+                match(')');
 
-                if (tmp > PTR && tmp == expr_type) {
-                    // pointers subtraction
-                    *++text = SUB;
-                    *++text = PUSH;
-                    *++text = IMM;
-                    *++text = sizeof(int);
-                    *++text = DIV;
-                    expr_type = INT;
-                } else if (tmp > PTR) {
-                    // pointer movement
-                    *++text = PUSH;
-                    *++text = IMM;
-                    *++text = sizeof(int);
-                    *++text = MUL;
-                    *++text = SUB;
-                    expr_type = tmp;
+                if (tmp != id[Params]) {
+                    printf("%d: bad number of arguments\n", line);
+                    exit(-1);
+                }
+                if (inline_report) {
+                    printf("%d: inlined call to ", line);
+                    print_name(id);
+                    printf(" (%d words)\n", id[Size]);
+                }
+                inline_code(id, base);
+
+                expr_type = id[Type];
+            } else if (token == '(') {  // function call
+                match('(');
+
+                // pass in arguments, a long long one in two words if the
+                // parameter is one
+                tmp = 0;  // number of arguments
+                words = 0;
+                while (token != ')') {
+                    expression(Assign);
+                    if (id[Class] == Fun && tmp < 8 * (int) sizeof(int) - 1 &&
+                        (id[Wides] >> tmp & 1)) {
+                        widen(expr_type, 0);
+                        *++text = PUSH64;
+                        words = words + 2;
+                    } else {
+                        *++text = PUSH;
+                        words++;
+                    }
+                    ++tmp;
+
+                    if (token == ',') {
+                        match(',');
+                    }
+                }
+                match(')');
+
+                // emit code
+                if (id[Class] == Sys) {  // system functions
+                    *++text = id[Value];
+                } else if (id[Class] == Fun) {  // function call
+                    *++text = CALL;
+                    *++text = id[Value];
                 } else {
-                    // numeral subtraction
-                    *++text = SUB;
-                    expr_type = tmp;
+                    printf("%d: bad function call\n", line);
+                    exit(-1);
                 }
-            } else if (token == Mul) {
-                // multiply
-                match(Mul);
-                *++text = PUSH;
-                expression(Inc);
-                *++text = MUL;
-                expr_type = tmp;
-            } else if (token == Div) {
-                // division
-                match(Div);
-                *++text = PUSH;
-                expression(Inc);
-                *++text = DIV;
-                expr_type = tmp;
-            } else if (token == Mod) {
-                // modulo
-                match(Mod);
-                *++text = PUSH;
-                expression(Inc);
-                *++text = MOD;
-                expr_type = tmp;
-            } else if (token == Inc || token == Dec) {
-                // postfix inc(++) and dec(--)
-                // we will increase the value to the variable and decrease it
-                // on `ax` to get its original value.
-                if (*text == LC) {
-                    *text = PUSH;
-                    *++text = LC;
-                } else if (*text == LI) {
-                    *text = PUSH;
-                    *++text = LI;
+
+                // clean the stack for arguments
+                if (words > 0) {
+                    *++text = ADJ;
+                    *++text = words;
+                }
+
+                expr_type = id[Type];
+            } else if (id[Class] == Fun) {  // function, its code address
+                *++text = FUN;
+                *++text = id[Value];
+                expr_type = INT;
+            } else if (id[Class] == Num) {  // enum
+                *++text = IMM;
+                *++text = id[Value];
+                expr_type = INT;
+            } else if (id[Class] == Loc && !is_char(id[Type]) &&
+                       !is_wide(id[Type]) && !is_struct(id[Type]) &&
+                       !id[Array]) {
+                // int and pointer locals are used like registers, LL loads
+                // them straight from the frame and SL stores them
+                *++text = LL;
+                *++text = index_of_bp - id[Value];
+                last_ll = text - 1;
+                expr_type = id[Type];
+            } else {  // variable
+                if (id[Class] == Loc) {
+                    *++text = LEA;
+                    *++text = index_of_bp - id[Value];
+                    addr_taken =
+                        addr_taken || is_struct(id[Type]) || id[Array];
+                } else if (id[Class] == Glo) {
+                    *++text = IMM;
+                    *++text = id[Value];
                 } else {
-                    printf("%d: bad value in increment\n", line);
+                    printf("%d: undefined variable\n", line);
                     exit(-1);
                 }
+                // emit code
+                // default behaviour is to load the value of the address which
+                // is stored in `ax`
+                // an array is the address of its first element
+                expr_type = id[Type];
+                if (!id[Array]) {
+                    load(expr_type);
+                }
+            }
+        } else if (token == '(') {  // cast or parenthesis
+            match('(');
+
+            if (token == Int || token == Char || token == Unsigned ||
+                token == Long || token == Struct) {
+                tmp = type_specifier(INT);  // cast type
+
+                while (token == Mul) {
+                    match(Mul);
+                    tmp = tmp + PTR;
+                }
+
+                match(')');
+                expression(Inc);  // cast has precedence as Inc(++)
+                if (tmp == UCHAR && *text != LCU) {  // not already 0..255
+                    binary_imm(AND, 255, lhs);
+                } else if (is_wide(tmp)) {
+                    widen(expr_type, 0);
+                }
+                expr_type = tmp;
+            } else {  // normal parenthesis
+                expression(Assign);
+                match(')');
+            }
+        } else if (token == Mul) {  // dereference *<addr>
+            match(Mul);
+            expression(Inc);  // dereference has the same precedence as Inc(++)
+
+            if (expr_type >= PTR) {
+                expr_type = expr_type - PTR;
+            } else {
+                printf("%d: bad dereference\n", line);
+                exit(-1);
+            }
+
+            load(expr_type);
+        } else if (token == And) {  // get the address of
+            match(And);
+            expression(Inc);
+            member_address(lhs);
+
+            if (is_struct(expr_type)) {
+                // already its address
+            } else if (last_ll == text - 1 && *last_ll == LL) {
+                *last_ll = LEA;
+                addr_taken = 1;
+            } else if (*text == LIX) {
+                *text = IDX;
+            } else if (*text == LC || *text == LCU || *text == LI ||
+                       *text == LI64) {
+                text--;
+                if (text[-1] == LEA) {
+                    addr_taken = 1;  // our frame must outlive tail calls
+                }
+            } else {
+                printf("%d: bad address\n", line);
+                exit(-1);
+            }
+
+            expr_type = expr_type + PTR;
+        } else if (token == '!') {  // not
+            match('!');
+            expression(Inc);
+
+            // emit code, use <expr> == 0
+            truth(expr_type);
+            binary_imm(EQ, 0, lhs);
+
+            expr_type = INT;
+        } else if (token == '~') {  // bitwise not
+            match('~');
+            expression(Inc);
+            tmp = expr_type;
+
+            // emit code, use <expr> ^ 0xFFFF(-1)
+            if (is_wide(tmp)) {
+                wide_imm(XOR, -1);
+            } else {
+                binary_imm(XOR, -1, lhs);
+            }
+
+            expr_type = promote(tmp);
+        } else if (token == Add) {  // +var, do nothing
+            match(Add);
+            expression(Inc);
+
+            expr_type = promote(expr_type);
+        } else if (token == Sub) {  // -var
+            match(Sub);
+
+            if (token == Num && !is_wide(token_type)) {
+                *++text = IMM;
+                *++text = -token_val;
+                expr_type = token_type;
+                match(Num);
+            } else {  // -x == -1 * x
+                expression(Inc);
+                tmp = expr_type;
+                if (is_wide(tmp)) {
+                    wide_imm(MUL, -1);
+                } else {
+                    binary_imm(MUL, -1, lhs);
+                }
+                expr_type = promote(tmp);
+            }
+        } else if (token == Inc || token == Dec) {
+            tmp = token;
+            match(token);
+            expression(Inc);
+            member_address(lhs);
+
+            if (last_ll == text - 1 && *last_ll == LL) {
+                slot = *text;
+                binary_imm((tmp == Inc) ? ADD : SUB, type_step(expr_type),
+                           text - 1);
+                *++text = SL;
+                *++text = slot;
+            } else {
+                if (*text == LC) {
+                    *text = PUSH;  // to duplicate the address
+                    *++text = LC;
+                } else if (*text == LCU) {
+                    *text = PUSH;
+                    *++text = LCU;
+                } else if (*text == LI) {
+                    *text = PUSH;
+                    *++text = LI;
+                } else if (*text == LI64) {
+                    *text = PUSH;
+                    *++text = LI64;
+                } else if (*text == LIX) {
+                    *text = IDX;
+                    *++text = PUSH;
+                    *++text = LI;
+                } else {
+                    printf("%d: bad lvalue of pre-increment\n", line);
+                    exit(-1);
+                }
+
+                if (is_wide(expr_type)) {
+                    wide_imm((tmp == Inc) ? ADD : SUB, 1);
+                } else {
+                    binary_imm((tmp == Inc) ? ADD : SUB, type_step(expr_type),
+                               text);
+                }
+                store(expr_type);
+            }
+        } else {
+            printf("%d: bad expression\n", line);
+            exit(-1);
+        }
+    }
+
+    // binary operator and postfix operators.
+    {
+        while (token >= level) {
+            // handle according to current operator's precedence
+            tmp = expr_type;
+
+            if (token == Assign) {
+                // var = expr;
+                match(Assign);
+                if (last_ll == text - 1 && *last_ll == LL) {
+                    slot = *text;
+                    text = text - 2;  // drop the load, SL stores the value
+                    expression(Assign);
+
+                    expr_type = tmp;
+                    *++text = SL;
+                    *++text = slot;
+                } else if (last_field == text - 1 &&
+                           (*last_field == LIO || *last_field == LCO)) {
+                    // store at the member's offset of the address pushed
+                    slot = *text;
+                    text = text - 2;
+                    *++text = PUSH;
+                    expression(Assign);
+
+                    expr_type = tmp;
+                    *++text = (expr_type == CHAR) ? SCO : SIO;
+                    *++text = slot;
+                } else {
+                    addr = 0;
+                    if (*text == LIX) {
+                        *text = PUSH;  // keep base and index for SIX
+                        addr = text;
+                    } else if (*text == LC || *text == LCU || *text == LI ||
+                               *text == LI64) {
+                        *text = PUSH;  // save the lvalue's address
+                    } else {
+                        printf("%d: bad lvalue in assignment\n", line);
+                        exit(-1);
+                    }
+                    expression(Assign);
+
+                    if (is_wide(tmp)) {
+                        widen(expr_type, 0);
+                    }
+                    expr_type = tmp;
+                    if (addr) {
+                        *++text = SIX;
+                    } else {
+                        store(expr_type);
+                    }
+                }
+            } else if (token == Cond) {
+                // expr ? a : b;
+                match(Cond);
+                if (cond) {
+                    cond_value();
+                    cond = 0;
+                }
+                addr = jump_if(1, 0);
+                expression(Assign);
+                tmp = expr_type;
+
+                if (token == ':') {
+                    match(':');
+                } else {
+                    printf("%d: missing colon in conditional\n", line);
+                    exit(-1);
+                }
+
+                *addr = (int) (text + 3);
+                *++text = JMP;
+                addr = ++text;
+                expression(Cond);
+                if (is_wide(tmp) && !is_wide(expr_type)) {
+                    widen(expr_type, 0);
+                    expr_type = tmp;
+                } else if (!is_wide(tmp) && is_wide(expr_type)) {
+                    // the first value is widened on its way out
+                    *++text = JMP;
+                    *addr = (int) (text + 2);
+                    addr = ++text;
+                    widen(tmp, 0);
+                }
+                *addr = (int) (text + 1);
+            } else if (token == Lor) {
+                // logic or
+                match(Lor);
+                if (cond) {
+                    // branch straight to the true target, a false left
+                    // operand goes on to test the right one.
+                    cond_true = jump_if(0, cond_true);
+                    patch(cond_false, text + 1);
+                    cond_false = 0;
+                    in_cond = 1;
+                    expression(Lan);
+                    truth(expr_type);
+                } else {
+                    truth(expr_type);
+                    *++text = JNZ;
+                    addr = ++text;
+                    expression(Lan);
+                    truth(expr_type);
+                    *addr = (int) (text + 1);
+                }
+                expr_type = INT;
+            } else if (token == Lan) {
+                // logic and
+                match(Lan);
+                if (cond) {
+                    cond_false = jump_if(1, cond_false);
+                    in_cond = 1;
+                    expression(Or);
+                    truth(expr_type);
+                } else {
+                    truth(expr_type);
+                    *++text = JZ;
+                    addr = ++text;
+                    expression(Or);
+                    truth(expr_type);
+                    *addr = (int) (text + 1);
+                }
+                expr_type = INT;
+            } else if (token == Or) {
+                // bitwise or
+                match(Or);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Xor);
+                if (!binary_wide(OR, tmp, expr_type)) {
+                    binary(OR, lhs, addr);
+                }
+                expr_type = arith_type(tmp, expr_type);
+            } else if (token == Xor) {
+                // bitwise xor
+                match(Xor);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(And);
+                if (!binary_wide(XOR, tmp, expr_type)) {
+                    binary(XOR, lhs, addr);
+                }
+                expr_type = arith_type(tmp, expr_type);
+            } else if (token == And) {
+                // bitwise and
+                match(And);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Eq);
+                if (!binary_wide(AND, tmp, expr_type)) {
+                    binary(AND, lhs, addr);
+                }
+                expr_type = arith_type(tmp, expr_type);
+            } else if (token == Eq) {
+                // equal ==
+                match(Eq);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Ne);
+                if (!binary_wide(EQ, tmp, expr_type)) {
+                    binary(EQ, lhs, addr);
+                }
+                expr_type = INT;
+            } else if (token == Ne) {
+                // not equal !=
+                match(Ne);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Lt);
+                if (!binary_wide(NE, tmp, expr_type)) {
+                    binary(NE, lhs, addr);
+                }
+                expr_type = INT;
+            } else if (token == Lt) {
+                // less than <
+                match(Lt);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Shl);
+                if (!binary_wide(LT, tmp, expr_type)) {
+                    binary(sign_op(LT, tmp, expr_type), lhs, addr);
+                }
+                expr_type = INT;
+            } else if (token == Gt) {
+                // greater than >
+                match(Gt);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Shl);
+                if (!binary_wide(GT, tmp, expr_type)) {
+                    binary(sign_op(GT, tmp, expr_type), lhs, addr);
+                }
+                expr_type = INT;
+            } else if (token == Le) {
+                // less than or equal to <=
+                match(Le);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Shl);
+                if (!binary_wide(LE, tmp, expr_type)) {
+                    binary(sign_op(LE, tmp, expr_type), lhs, addr);
+                }
+                expr_type = INT;
+            } else if (token == Ge) {
+                // greater than or equal to >=
+                match(Ge);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Shl);
+                if (!binary_wide(GE, tmp, expr_type)) {
+                    binary(sign_op(GE, tmp, expr_type), lhs, addr);
+                }
+                expr_type = INT;
+            } else if (token == Shl) {
+                // shift left
+                match(Shl);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Add);
+                if (!binary_wide(SHL, tmp, expr_type)) {
+                    binary(SHL, lhs, addr);
+                }
+                expr_type = promote(tmp);
+            } else if (token == Shr) {
+                // shift right
+                match(Shr);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Add);
+                if (!binary_wide(SHR, tmp, expr_type)) {
+                    binary(sign_op(SHR, tmp, tmp), lhs, addr);
+                }
+                expr_type = promote(tmp);
+            } else if (token == Add) {
+                // add
+                match(Add);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Mul);
+
+                if (binary_wide(ADD, tmp, expr_type)) {
+                    expr_type = arith_type(tmp, expr_type);
+                } else {
+                    expr_type = arith_type(tmp, expr_type);
+                    if (type_step(expr_type) == sizeof(int) &&
+                        !(text == addr + 2 && addr[1] == IMM)) {
+                        // pointer to words, scaled by IDX
+                        *++text = IDX;
+                    } else {
+                        if (type_step(expr_type) > 1) {
+                            binary_imm(MUL, type_step(expr_type), addr + 1);
+                        }
+                        binary(ADD, lhs, addr);
+                    }
+                }
+            } else if (token == Sub) {
+                // sub
+                match(Sub);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Mul);
+
+                if (tmp > PTR && tmp == expr_type) {
+                    // pointers subtraction
+                    // the difference is a multiple of the size, so the
+                    // division is exact and a shift will do for a power of 2
+                    binary(SUB, lhs, addr);
+                    if (log2_of(type_step(tmp)) >= 0) {
+                        binary_imm(SHR, log2_of(type_step(tmp)), lhs);
+                    } else {
+                        binary_imm(DIV, type_step(tmp), lhs);
+                    }
+                    expr_type = INT;
+                } else if (tmp > PTR) {
+                    // pointer movement
+                    binary_imm(MUL, type_step(tmp), addr + 1);
+                    binary(SUB, lhs, addr);
+                    expr_type = tmp;
+                } else {
+                    // numeral subtraction
+                    if (!binary_wide(SUB, tmp, expr_type)) {
+                        binary(SUB, lhs, addr);
+                    }
+                    expr_type = arith_type(tmp, expr_type);
+                }
+            } else if (token == Mul) {
+                // multiply
+                match(Mul);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Inc);
+                if (!binary_wide(MUL, tmp, expr_type)) {
+                    binary(MUL, lhs, addr);
+                }
+                expr_type = arith_type(tmp, expr_type);
+            } else if (token == Div) {
+                // division
+                match(Div);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Inc);
+                if (!binary_wide(DIV, tmp, expr_type)) {
+                    binary(sign_op(DIV, tmp, expr_type), lhs, addr);
+                }
+                expr_type = arith_type(tmp, expr_type);
+            } else if (token == Mod) {
+                // modulo
+                match(Mod);
+                *++text = is_wide(tmp) ? PUSH64 : PUSH;
+                addr = text;
+                expression(Inc);
+                if (!binary_wide(MOD, tmp, expr_type)) {
+                    binary(sign_op(MOD, tmp, expr_type), lhs, addr);
+                }
+                expr_type = arith_type(tmp, expr_type);
+            } else if (token == Inc || token == Dec) {
+                // postfix inc(++) and dec(--)
+                // we will increase the value to the variable and decrease it
+                // on `ax` to get its original value.
+                member_address(lhs);
+                if (last_ll == text - 1 && *last_ll == LL) {
+                    slot = *text;
+                    binary_imm((token == Inc) ? ADD : SUB, type_step(expr_type),
+                               text - 1);
+                    *++text = SL;
+                    *++text = slot;
+                } else {
+                    if (*text == LC) {
+                        *text = PUSH;
+                        *++text = LC;
+                    } else if (*text == LCU) {
+                        *text = PUSH;
+                        *++text = LCU;
+                    } else if (*text == LI) {
+                        *text = PUSH;
+                        *++text = LI;
+                    } else if (*text == LI64) {
+                        *text = PUSH;
+                        *++text = LI64;
+                    } else if (*text == LIX) {
+                        *text = IDX;
+                        *++text = PUSH;
+                        *++text = LI;
+                    } else {
+                        printf("%d: bad value in increment\n", line);
+                        exit(-1);
+                    }
+
+                    if (is_wide(expr_type)) {
+                        wide_imm((token == Inc) ? ADD : SUB, 1);
+                    } else {
+                        binary_imm((token == Inc) ? ADD : SUB,
+                                   type_step(expr_type), text);
+                    }
+                    store(expr_type);
+                }
+                if (is_wide(expr_type)) {
+                    wide_imm((token == Inc) ? SUB : ADD, 1);
+                } else {
+                    binary_imm((token == Inc) ? SUB : ADD, type_step(expr_type),
+                               text);
+                }
+                match(token);
+            } else if (token == Brak) {
+                // array access var[xx]
+                match(Brak);
+                *++text = PUSH;
+                addr = text;
+                expression(Assign);
+                match(']');
+
+                if (tmp < PTR) {
+                    printf("%d: pointer type expected\n", line);
+                    exit(-1);
+                }
+                expr_type = tmp - PTR;
+                if (type_step(tmp) == sizeof(int) && !is_struct(expr_type) &&
+                    !(text == addr + 2 && addr[1] == IMM)) {
+                    // array of words with a variable index
+                    *++text = LIX;
+                } else {
+                    if (type_step(tmp) > 1) {
+                        binary_imm(MUL, type_step(tmp), addr + 1);
+                    }
+                    binary(ADD, lhs, addr);
+                    load(expr_type);
+                }
+            } else if (token == Dot || token == Arrow) {
+                // struct member s.m, or through a pointer p->m
+                if (!is_struct((token == Dot) ? tmp : tmp - PTR)) {
+                    printf("%d: struct expected\n", line);
+                    exit(-1);
+                }
+                tmp = (token == Dot) ? tmp : tmp - PTR;
+                match(token);
+                if (token != Id || !(id = struct_member(tmp, current_id))) {
+                    printf("%d: bad struct member\n", line);
+                    exit(-1);
+                }
+                match(Id);
+                expr_type = id[MemType];
+                member_load(id[MemOffset], expr_type, lhs);
+            } else {
+                printf("%d: compiler error, token = %d\n", line, token);
+                exit(-1);
+            }
+        }
+    }
+}
+
+int *condition()
+{
+    // `(<cond>)` of if/while is compiled straight into control flow: the
+    // comparison is fused with its test and `&&`/`||` jump directly to the
+    // final targets instead of materializing a boolean in `ax`.
+    //
+    //   if (a < b && c)                  <a> PUSH <b> JGE f
+    //                          ===>      <c> JZ f
+    //     <statement>                    <statement>
+    //                                 f:
+    //
+    // the true case falls through, the returned chain of jumps is taken when
+    // the condition is false.
+    int *f;
+
+    match('(');
+    cond_true = cond_false = 0;
+    in_cond = 1;
+    expression(Assign);
+    match(')');
+
+    f = jump_if(1, cond_false);
+    patch(cond_true, text + 1);
+    cond_true = cond_false = 0;
+    return f;
+}
+
+// jump to `target`, or to the end of the innermost switch if it is 0
+void case_jump(int *target)
+{
+    *++text = JMP;
+    if (target) {
+        *++text = (int) target;
+    } else {
+        *++text = (int) breaks;
+        breaks = text;
+    }
+}
+
+// dispatch on ax to the cases from `p` to `end`, sorted pairs of value and
+// address, with a binary search of JEQIs and JLTIs
+void case_tree(int *p, int *end)
+{
+    int *mid, *lt;
+
+    if (end - p <= 3 * 2) {
+        while (p < end) {
+            *++text = JEQI;
+            *++text = p[0];
+            *++text = p[1];
+            p = p + 2;
+        }
+        case_jump(case_default);
+        return;
+    }
+    mid = p + (end - p) / 4 * 2;
+    *++text = JEQI;
+    *++text = mid[0];
+    *++text = mid[1];
+    *++text = JLTI;
+    *++text = mid[0];
+    *++text = 0;
+    lt = text;
+    case_tree(mid + 2, end);
+    *lt = (int) (text + 1);
+    case_tree(p, mid);
+}
+
+// dispatch on ax to the case labels from `p` to `end` of a switch: a dense
+// set of them jumps through a table, indexed by the value less the lowest
+// one, a sparse one searches them.
+//
+//   SUBI <lowest>
+//   JTAB <n>
+//   JMP <case lowest>
+//   ...
+//   JMP <case lowest + n - 1>
+//   JMP <default>
+void switch_dispatch(int *p, int *end)
+{
+    int *q, *r, n, v;
+
+    // sort them by value
+    q = p + 2;
+    while (q < end) {
+        n = q[0];
+        v = q[1];
+        r = q;
+        while (r > p && r[-2] > n) {
+            r[0] = r[-2];
+            r[1] = r[-1];
+            r = r - 2;
+        }
+        r[0] = n;
+        r[1] = v;
+        q = q + 2;
+    }
+
+    n = (end - p) / 2;
+    q = p + 2;
+    while (q < end) {
+        if (q[0] == q[-2]) {
+            printf("%d: duplicate case value %d\n", line, q[0]);
+            exit(-1);
+        }
+        q = q + 2;
+    }
+
+    if (n < 4 || (unsigned) end[-2] - (unsigned) p[0] >= 3 * (unsigned) n) {
+        case_tree(p, end);
+        return;
+    }
+    if (p[0]) {
+        *++text = SUBI;
+        *++text = p[0];
+    }
+    *++text = JTAB;
+    *++text = end[-2] - p[0] + 1;
+    v = p[0];
+    while (p < end) {
+        if (p[0] == v) {
+            case_jump((int *) p[1]);
+            p = p + 2;
+        } else {
+            case_jump(case_default);
+        }
+        v++;
+    }
+    case_jump(case_default);
+}
+
+void statement()
+{
+    // there are 9 kinds of statements here:
+    // 1. if (...) <statement> [else <statement>]
+    // 2. while (...) <statement>
+    // 3. switch (...) <statement>
+    // 4. case <constant>: and default:
+    // 5. break;
+    // 6. { <statement> }
+    // 7. return xxx;
+    // 8. <empty statement>;
+    // 9. expression; (expression end with semicolon)
+
+    int *a, *b;  // bess for branch control
+    int *c, *d;
+
+    lines[text + 1 - old_text] = line;
+
+    if (token == If) {
+        // if (...) <statement> [else <statement>]
+        //
+        //   if (<cond>)                   <cond>
+        //                                 JZ a
+        //     <true_statement>   ===>     <true_statement>
+        //   else:                         JMP b
+        // a:                           a:
+        //     <false_statement>           <false_statement>
+        // b:                           b:
+
+        match(If);
+        b = condition();  // parse condition, emit code for JZ a
+
+        statement();  // parse true statement
+
+        if (token == Else) {
+            match(Else);
+
+            // emit code for JMP b
+            *++text = JMP;
+            *++text = 0;
+            a = text;
+            patch(b, text + 1);
+            b = a;
+
+            statement();  // parse false statement
+        }
+
+        patch(b, text + 1);
+    } else if (token == While) {
+        // a:                       a:
+        //    while (<cond>)          <cond>
+        //                            JZ b
+        //     <statement>    ===>    <statement>
+        //                            JMP a
+        // b:                       b:
+
+        match(While);
+        a = text + 1;
+        b = condition();  // parse condition, emit code for JZ b
+
+        c = breaks;
+        breaks = 0;
+        statement();  // parse statement
+
+        // emit code for JMP a
+        *++text = JMP;
+        *++text = (int) a;
+        patch(b, text + 1);
+        patch(breaks, text + 1);
+        breaks = c;
+    } else if (token == Switch) {
+        //   switch (<expr>)                <expr>
+        //                                  JMP d
+        //     <statement>      ===>        <statement>
+        //                                  JMP b
+        //                               d: <dispatch>
+        //                               b:
+        //
+        // the cases are only known once the statement is compiled, so the
+        // dispatch on the value in ax follows it.
+
+        match(Switch);
+        match('(');
+        expression(Assign);
+        match(')');
+        if (is_wide(expr_type)) {
+            printf("%d: switch on a long long\n", line);
+            exit(-1);
+        }
+        *++text = JMP;
+        *++text = 0;
+        d = text;
+
+        a = cases;
+        b = case_default;
+        c = breaks;
+        cases = case_top;
+        case_default = 0;
+        breaks = 0;
+        statement();
+
+        *++text = JMP;
+        *++text = (int) breaks;
+        breaks = text;
+        patch(d, text + 1);
+        switch_dispatch(cases, case_top);
+
+        patch(breaks, text + 1);
+        case_top = cases;
+        cases = a;
+        case_default = b;
+        breaks = c;
+    } else if (token == Case || token == Default) {
+        // a label of the innermost switch
+        if (!cases) {
+            printf("%d: case label not within a switch\n", line);
+            exit(-1);
+        }
+        if (token == Default) {
+            match(Default);
+            if (case_default) {
+                printf("%d: duplicate default label\n", line);
+                exit(-1);
+            }
+            case_default = text + 1;
+        } else {
+            match(Case);
+            a = text;
+            expression(Lor);
+            if (text != a + 2 || a[1] != IMM) {
+                printf("%d: case label is not a constant\n", line);
+                exit(-1);
+            }
+            text = a;
+            if ((char *) (case_top + 2) > (char *) ir_arena + pool_size) {
+                printf("%d: too many case labels\n", line);
+                exit(-1);
+            }
+            *case_top++ = a[2];
+            *case_top++ = (int) (text + 1);
+        }
+        match(':');
+    } else if (token == Break) {
+        match(Break);
+        match(';');
+        if (breaks == (int *) -1) {
+            printf("%d: break not within a switch or while\n", line);
+            exit(-1);
+        }
+        *++text = JMP;
+        *++text = (int) breaks;
+        breaks = text;
+    } else if (token == Return) {
+        // return [expression];
+        match(Return);
+
+        if (token != ';') {
+            expression(Assign);
+            if (is_wide(fun_type)) {
+                widen(expr_type, 0);
+            }
+        }
+        match(';');
+
+        // emit code for return
+        *++text = LEV;
+    } else if (token == '{') {
+        // { <statement> ... }
+        match('{');
+        while (token != '}') {
+            statement();
+        }
+        match('}');
+    } else if (token == ';') {
+        // empty statement
+        match(';');
+    } else {
+        // `a= b;` or `function_call()`
+        expression(Assign);
+        match(';');
+    }
+}
+
+// parse the parameters, and return a bit for each that is a long long
+int function_parameter()
+{
+    int type;
+    int params;
+    int n;      // number of them
+    int wides;
+    params = 0;
+    n = 0;
+    wides = 0;
+
+    while (token != ')') {
+        // e.g. int name, ...
+        type = type_specifier(INT);
+
+        // pointer type, e.g. int ****a
+        while (token == Mul) {
+            match(Mul);
+            type = type + PTR;
+        }
+
+        // parameter name
+        if (token != Id) {  // invalid declaration
+            printf("%d: bad parameter declaration\n", line);
+            exit(-1);
+        }
+        if (is_struct(type)) {
+            printf("%d: struct parameter, pass a pointer to it\n", line);
+            exit(-1);
+        }
+        if (current_id[Class] == Loc) {  // identifier exists
+            printf("%d: duplicate parameter declaration\n", line);
+            exit(-1);
+        }
+        match(Id);
+
+        // store the parameter
+        current_id[BClass] = current_id[Class];
+        current_id[Class] = Loc;
+        current_id[BType] = current_id[Type];
+        current_id[Type] = type;
+        current_id[BValue] = current_id[Value];
+        if (is_wide(type)) {
+            if (n >= 8 * (int) sizeof(int) - 1) {
+                printf("%d: too many parameters before a long long one\n",
+                       line);
+                exit(-1);
+            }
+            wides = wides | 1 << n;
+            params++;  // its high word, pushed first
+        }
+        current_id[Value] = params++;  // index of current parameter
+        n++;
+
+        if (token == ',') {
+            match(',');
+        }
+    }
+
+    index_of_bp = params + 1;  // set index of bp pointer
+    return wides;
+}
+
+void tail_calls(int *p)
+{
+    // calls in tail position of the function whose code starts at `p` reuse
+    // our frame: the arguments are moved over our own, then the frame is
+    // dropped and the callee entered with our return address, so recursion
+    // in tail position runs in constant stack space.
+    //
+    //   CALL f                   TARG n
+    //   ADJ n           ===>     TAIL f
+    //   LEV                      LEV
+    //
+    // the caller's ADJ pops our arguments, so only calls passing as many
+    // arguments as we have are turned into tail calls.
+    int n;
+
+    while (p < text) {
+        if (*p == CALL) {
+            n = (p[2] == ADJ) ? p[3] : 0;
+            if (n == index_of_bp - 1 && p[n ? 4 : 2] == LEV) {
+                if (n) {
+                    p[2] = TAIL;
+                    p[3] = p[1];
+                    p[0] = TARG;
+                    p[1] = n;
+                } else {
+                    p[0] = TAIL;
+                }
+            }
+        }
+        p = p + 1 + op_operands(*p);
+    }
+}
+
+void function_body()
+{
+    // type func_name (...) {...}
+    //                   -->|   |<--
+
+    // ... {
+    // 1. local declarations
+    // 2. statements
+    // }
+
+    int type;
+    int pos_local;  // position of local variables on the stack
+    int n;          // number of elements of an array
+    int *ent;
+    int *id;
+    pos_local = index_of_bp;
+    addr_taken = 0;
+    breaks = (int *) -1;
+    cases = 0;
+    case_top = ir_arena;  // free until the function is optimized
+
+    while (token == Int || token == Char || token == Unsigned ||
+           token == Long || token == Struct) {
+        // local variable declaration, just like global ones
+        base_type = type_specifier(INT);
+
+        while (token != ';') {
+            type = base_type;
+            while (token == Mul) {
+                match(Mul);
+                type = type + PTR;
+            }
+
+            if (token != Id) {  // invalid declaration
+                printf("%d: bad local declaration\n", line);
+                exit(-1);
+            }
+            if (current_id[Class] == Loc) {  // identifier exists
+                printf("%d: duplicate parameter declaration\n", line);
+                exit(-1);
+            }
+            if (!type_size(type)) {
+                printf("%d: variable of incomplete struct type\n", line);
+                exit(-1);
+            }
+            id = current_id;
+            match(Id);
+
+            // array, e.g. int buf[64]
+            n = 0;
+            if (token == Brak) {
+                match(Brak);
+                if (token != Num || token_val <= 0) {
+                    printf("%d: bad array size\n", line);
+                    exit(-1);
+                }
+                n = token_val;
+                match(Num);
+                match(']');
+            }
+
+            // store the local variable, a struct or an array in consecutive
+            // slots from the lowest address on
+            id[BClass] = id[Class];
+            id[Class] = Loc;
+            id[BType] = id[Type];
+            id[BValue] = id[Value];
+            id[Array] = n;
+            if (n) {
+                id[Type] = type + PTR;  // used as a pointer to its elements
+                n = (n * type_size(type) + sizeof(int) - 1) / sizeof(int);
+                pos_local = pos_local + n;  // in words
+            } else {
+                id[Type] = type;
+                pos_local = pos_local + type_words(type);
+            }
+            id[Value] = pos_local;  // index of current local variable
+
+            if (token == ',') {
+                match(',');
+            }
+        }
+
+        match(';');
+    }
+
+    // save the stack size for local variables
+    // inlined calls may still add slots while compiling the statements
+    *++text = ENT;
+    *++text = locals = pos_local - index_of_bp;
+    ent = text;
+
+    // statements
+    while (token != '}') {
+        statement();
+    }
+    *ent = locals;
+
+    // emit code for leaving the sub function
+    *++text = LEV;
+
+    if (opt_level >= 1 && !addr_taken) {
+        tail_calls(ent - 1);
+    }
+}
+
+// unwind local variable declarations for all local variables
+void unwind_locals()
+{
+    current_id = symbols;
+    while (current_id[Token]) {
+        if (current_id[Class] == Loc) {
+            current_id[Class] = current_id[BClass];
+            current_id[Type] = current_id[BType];
+            current_id[Value] = current_id[BValue];
+            current_id[Array] = 0;
+        }
+        current_id = current_id + IdSize;
+    }
+}
+
+void function_declaration(int *id)
+{
+    // type func_name (...) {...}
+    //               | this part
+
+    match('(');
+    id[Wides] = function_parameter();
+    match(')');
+    match('{');
+    fun_type = id[Type];
+    function_body();
+    // match('}');  // remain math('}') to global_declaration()
+
+    unwind_locals();
+}
+
+// allocate `n` words of the IR segment, which is reset for each function
+int *ir_alloc(int n)
+{
+    int *p;
+
+    p = ir_top;
+    ir_top = ir_top + n;
+    if ((char *) ir_top > (char *) ir_arena + pool_size) {
+        printf("%d: function too large to optimize\n", line);
+        exit(-1);
+    }
+    return p;
+}
+
+// the node of the instruction at `p` in text
+int ir_node(int *p)
+{
+    int lo, hi, mid;
+
+    lo = 0;
+    hi = ir_count;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((int *) ir[mid * IrSize + IrText] < p) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// lift the code from `p` to `end` into nodes
+void ir_lift(int *p, int *end)
+{
+    int *q, *n, t;
+
+    ir_top = ir_arena;
+    ir_count = 0;
+    q = p;
+    while (q < end) {
+        ir_count++;
+        q = q + 1 + op_operands(*q);
+    }
+    ir = ir_alloc(ir_count * IrSize);
+
+    n = ir;
+    while (p < end) {
+        n[IrOp] = *p;
+        n[IrArg] = p[1];
+        n[IrArg2] = p[2];
+        n[IrText] = (int) p;
+        n[IrAfter] = 0;
+        n[IrBefore] = 0;
+        n[IrPast] = 0;
+        n[IrLine] = lines[p - old_text];
+        p = p + 1 + op_operands(*p);
+        n = n + IrSize;
+    }
+
+    n = ir;
+    while (n < ir + ir_count * IrSize) {
+        t = op_target(n[IrOp]);
+        if (t >= 0) {
+            n[IrTarget] = ir_node((int *) n[IrArg + t]);
+        }
+        n = n + IrSize;
+    }
+}
+
+// does node `i` end a basic block
+int ir_ends_block(int i)
+{
+    int op;
+
+    op = ir[i * IrSize + IrOp];
+    return op_target(op) >= 0 || op == LEV || op == TAIL || op == JTAB;
+}
+
+// the first node from `i` on that has not been removed
+int ir_live(int i)
+{
+    while (i < ir_count && ir[i * IrSize + IrOp] < 0) {
+        i++;
+    }
+    return i;
+}
+
+// split the nodes into basic blocks: they start at the function, at the
+// target of a jump and after a jump or return.
+void ir_split()
+{
+    int i, b, *n;
+
+    i = 0;
+    while (i < ir_count) {
+        ir[i * IrSize + IrBlock] = 0;
+        i++;
+    }
+    ir[IrBlock] = 1;
+    i = 0;
+    while (i < ir_count) {
+        n = ir + i * IrSize;
+        if (op_target(n[IrOp]) >= 0 && n[IrTarget] < ir_count) {
+            ir[n[IrTarget] * IrSize + IrBlock] = 1;
+        }
+        if (ir_ends_block(i) && i + 1 < ir_count) {
+            n[IrSize + IrBlock] = 1;
+        }
+        i++;
+    }
+
+    block_count = 0;
+    i = 0;
+    while (i < ir_count) {
+        block_count = block_count + ir[i * IrSize + IrBlock];
+        i++;
+    }
+    blocks = ir_alloc(block_count * BSize);
+    b = -1;
+    i = 0;
+    while (i < ir_count) {
+        if (ir[i * IrSize + IrBlock]) {
+            b++;
+            blocks[b * BSize + BFirst] = i;
+        }
+        ir[i * IrSize + IrBlock] = b;
+        blocks[b * BSize + BEnd] = i + 1;
+        i++;
+    }
+
+    b = 0;
+    while (b < block_count) {
+        i = blocks[b * BSize + BEnd] - 1;
+        n = ir + i * IrSize;
+        blocks[b * BSize + BNext] = -1;
+        blocks[b * BSize + BJump] = -1;
+        if (n[IrOp] != JMP && n[IrOp] != LEV && n[IrOp] != TAIL &&
+            b + 1 < block_count) {
+            blocks[b * BSize + BNext] = b + 1;
+        }
+        if (op_target(n[IrOp]) >= 0 && n[IrTarget] < ir_count) {
+            blocks[b * BSize + BJump] = ir[n[IrTarget] * IrSize + IrBlock];
+        }
+        b++;
+    }
+}
+
+// jumps to a JMP go where it goes
+void ir_thread()
+{
+    int i, t, hops, *n;
+
+    i = 0;
+    while (i < ir_count) {
+        n = ir + i * IrSize;
+        if (op_target(n[IrOp]) >= 0) {
+            hops = 0;
+            t = n[IrTarget];
+            while (t < ir_count && ir[t * IrSize + IrOp] == JMP &&
+                   hops++ < ir_count) {
+                t = ir[t * IrSize + IrTarget];
+            }
+            n[IrTarget] = t;
+        }
+        i++;
+    }
+}
+
+// remove the blocks that cannot be reached from the entry of the function
+void ir_unreachable()
+{
+    int *work, top, b, i;
+
+    work = ir_alloc(block_count);
+    b = 0;
+    while (b < block_count) {
+        blocks[b * BSize + BMark] = 0;
+        b++;
+    }
+    top = 0;
+    work[top++] = 0;
+    blocks[BMark] = 1;
+    while (top > 0) {
+        b = work[--top];
+        // the JMPs of a table each are a block
+        i = blocks[b * BSize + BEnd] - 1;
+        if (ir[i * IrSize + IrOp] == JTAB) {
+            i = b + 1 + ir[i * IrSize + IrArg];
+            while (i > b + 1) {
+                if (!blocks[i * BSize + BMark]) {
+                    blocks[i * BSize + BMark] = 1;
+                    work[top++] = i;
+                }
+                i--;
+            }
+        }
+        i = blocks[b * BSize + BNext];
+        if (i >= 0 && !blocks[i * BSize + BMark]) {
+            blocks[i * BSize + BMark] = 1;
+            work[top++] = i;
+        }
+        i = blocks[b * BSize + BJump];
+        if (i >= 0 && !blocks[i * BSize + BMark]) {
+            blocks[i * BSize + BMark] = 1;
+            work[top++] = i;
+        }
+    }
+
+    b = 0;
+    while (b < block_count) {
+        if (!blocks[b * BSize + BMark]) {
+            i = blocks[b * BSize + BFirst];
+            while (i < blocks[b * BSize + BEnd]) {
+                ir[i * IrSize + IrOp] = -1;
+                i++;
+            }
+        }
+        b++;
+    }
+}
+
+// remove the JMPs to the node that follows them anyway, but those of a table
+void ir_fall_through()
+{
+    int i, k, *n, *table;
+
+    table = ir_alloc(ir_count);
+    k = 0;
+    i = 0;
+    while (i < ir_count) {
+        n = ir + i * IrSize;
+        table[i] = k > 0;
+        if (n[IrOp] == JTAB) {
+            k = n[IrArg] + 2;
+        }
+        k = k - (n[IrOp] >= 0);
+        i++;
+    }
+
+    i = ir_count - 1;
+    while (i >= 0) {
+        n = ir + i * IrSize;
+        if (n[IrOp] == JMP && !table[i] &&
+            ir_live(n[IrTarget]) == ir_live(i + 1) &&
+            !(n[IrPast] && ir[ir_live(i + 1) * IrSize + IrBefore])) {
+            n[IrOp] = -1;
+        }
+        i--;
+    }
+}
+
+// a node for instruction `op` with operand `arg`, outside the nodes of text
+int *ir_new(int op, int arg)
+{
+    int *m;
+
+    m = ir_alloc(IrSize);
+    m[IrOp] = op;
+    m[IrArg] = arg;
+    m[IrAfter] = 0;
+    m[IrBefore] = 0;
+    m[IrPast] = 0;
+    m[IrLine] = 0;
+    return m;
+}
+
+// insert instruction `op` with operand `arg` after node `n`
+int *ir_insert(int *n, int op, int arg)
+{
+    int *m;
+
+    m = ir_new(op, arg);
+    m[IrAfter] = n[IrAfter];
+    n[IrAfter] = (int) m;
+    return m;
+}
+
+// append instruction `op` with operand `arg` to those before node `i`
+void ir_before(int i, int op, int arg)
+{
+    int *n;
+
+    n = ir + i * IrSize;
+    if (!n[IrBefore]) {
+        n[IrBefore] = (int) ir_new(op, arg);
+        return;
+    }
+    n = (int *) n[IrBefore];
+    while (n[IrAfter]) {
+        n = (int *) n[IrAfter];
+    }
+    ir_insert(n, op, arg);
+}
+
+// does `op` only compute a value in ax from locals, memory and the stack:
+// no stores, calls or jumps
+int ir_pure(int op)
+{
+    return op == LL || op == IMM || op == LEA || op == PUSH || op == LI ||
+           op == LC || op == LCU || op == LIX || op == IDX || op == LIO ||
+           op == LCO || (op >= OR && op <= MODU);
+}
+
+// number of nodes left from `s` to `e`
+int ir_length(int s, int e)
+{
+    int n;
+
+    n = 0;
+    while (s <= e) {
+        n = n + (ir[s * IrSize + IrOp] >= 0);
+        s++;
+    }
+    return n;
+}
+
+// do the `len` nodes left from `s` on do the same as those from `t` on
+int ir_same(int s, int t, int len)
+{
+    int *a, *b;
+
+    while (len-- > 0) {
+        s = ir_live(s);
+        t = ir_live(t);
+        a = ir + s * IrSize;
+        b = ir + t * IrSize;
+        if (a[IrOp] != b[IrOp] || (op_operands(a[IrOp]) && a[IrArg] != b[IrArg])) {
+            return 0;
+        }
+        s++;
+        t++;
+    }
+    return 1;
+}
+
+// do the nodes from `s` to `e` load local `local`, or memory if `memory`
+int ir_reads(int s, int e, int local, int memory)
+{
+    int op;
+
+    while (s <= e) {
+        op = ir[s * IrSize + IrOp];
+        if ((op == LL && ir[s * IrSize + IrArg] == local) ||
+            (memory && (op == LI || op == LC || op == LCU || op == LIX ||
+                        op == LIO || op == LCO))) {
+            return 1;
+        }
+        s++;
+    }
+    return 0;
+}
+
+// local common subexpressions: a value that a block computes again, with
+// nothing stored or called in between, is kept in a fresh local the first
+// time and loaded from it the next.
+//
+//   LL a  PUSH  LL i  LIX  ...  LL a  PUSH  LL i  LIX
+//   ===>
+//   LL a  PUSH  LL i  LIX  SL t  ...  LL t
+//
+// the values are the balanced runs of pure instructions that end in ax,
+// found by tracking where the value in ax and each one pushed started.
+void ir_cse()
+{
+    int *push, *from, *to, *size, *tmp, *n;
+    int b, i, k, op, depth, start, count, len, lea;
+
+    if (ir[IrOp] != ENT) {
+        return;
+    }
+    // with the address of a local taken, a store to any local may change
+    // what a load from memory gives
+    lea = 0;
+    i = 0;
+    while (i < ir_count) {
+        lea = lea || ir[i * IrSize + IrOp] == LEA;
+        i++;
+    }
+
+    push = ir_alloc(ir_count);
+    from = ir_alloc(ir_count);
+    to = ir_alloc(ir_count);
+    size = ir_alloc(ir_count);
+    tmp = ir_alloc(ir_count);
+    b = 0;
+    while (b < block_count) {
+        depth = 0;
+        start = -1;
+        count = 0;  // values computed so far
+        i = blocks[b * BSize + BFirst];
+        while (i < blocks[b * BSize + BEnd]) {
+            n = ir + i * IrSize;
+            op = n[IrOp];
+            if (op < 0) {
+                i++;
+                continue;
+            }
+
+            if (!ir_pure(op)) {
+                // forget the values that it may change
+                k = 0;
+                while (k < count) {
+                    if (op == SL && !ir_reads(from[k], to[k], n[IrArg], lea)) {
+                        k++;
+                    } else if (op == ADJ) {
+                        k++;
+                    } else {
+                        count--;
+                        from[k] = from[count];
+                        to[k] = to[count];
+                        size[k] = size[count];
+                        tmp[k] = tmp[count];
+                    }
+                }
+                depth = depth - ((op == SI || op == SC || op == SIO ||
+                                  op == SCO)   ? 1
+                                 : (op == SIX) ? 2
+                                 : (op == ADJ) ? n[IrArg]
+                                               : 0);
+                depth = (depth < 0) ? 0 : depth;
+                k = 0;
+                while (k < depth) {
+                    push[k++] = -1;
+                }
+                start = -1;
+                i++;
+                continue;
+            }
+
+            if (op == PUSH) {
+                push[depth++] = start;
+                i++;
+                continue;
+            }
+            if (op == LL || op == IMM || op == LEA) {
+                start = i;
+            } else if ((op >= OR && op <= MOD) || (op >= LTU && op <= MODU) ||
+                       op == LIX || op == IDX) {
+                k = (depth > 0) ? push[--depth] : -1;
+                start = (start < 0) ? -1 : k;
+            }
+            if (start < 0 || (len = ir_length(start, i)) < 3) {
+                i++;
+                continue;
+            }
+
+            k = 0;
+            while (k < count && !(to[k] < start && size[k] == len &&
+                                  ir_same(from[k], start, len))) {
+                k++;
+            }
+            if (k == count) {
+                from[count] = start;
+                to[count] = i;
+                size[count] = len;
+                tmp[count] = 0;
+                count++;
+            } else {
+                if (!tmp[k]) {
+                    tmp[k] = -++ir[IrArg];  // a new local slot
+                    ir_insert(ir + to[k] * IrSize, SL, tmp[k]);
+                }
+                ir[start * IrSize + IrArg] = tmp[k];
+                ir[start * IrSize + IrOp] = LL;
+                k = start + 1;
+                while (k <= i) {
+                    ir[k * IrSize + IrOp] = -1;
+                    k++;
+                }
+                // the values computed inside it are gone
+                k = 0;
+                while (k < count) {
+                    if (to[k] >= start) {
+                        count--;
+                        from[k] = from[count];
+                        to[k] = to[count];
+                        size[k] = size[count];
+                        tmp[k] = tmp[count];
+                    } else {
+                        k++;
+                    }
+                }
+            }
+            i++;
+        }
+        b++;
+    }
+}
+
+// can the nodes from `s` to `e` run where the loop they are in would not
+// have: they load memory only at the address of a global, and do not
+// divide by what may be zero
+int ir_safe(int s, int e)
+{
+    int op, prev, *n;
+
+    prev = -1;
+    while (s <= e) {
+        n = ir + s * IrSize;
+        op = n[IrOp];
+        if (op < 0) {
+            s++;
+            continue;
+        }
+        if ((op == LI || op == LC || op == LCU) &&
+            !(prev >= 0 && ir[prev * IrSize + IrOp] == IMM &&
+              ir[prev * IrSize + IrArg] >= (int) old_data &&
+              ir[prev * IrSize + IrArg] < (int) data)) {
+            return 0;
+        }
+        if (op == LIX || op == LIO || op == LCO || op == DIV || op == MOD ||
+            op == DIVU || op == MODU ||
+            ((op == DIVI || op == MODI) && (n[IrArg] == 0 || n[IrArg] == -1))) {
+            return 0;
+        }
+        prev = s;
+        s++;
+    }
+    return 1;
+}
+
+// loop-invariant code motion: a value that a loop computes the same on each
+// iteration is computed once before it is entered, into a fresh local.
+//
+//   top: LL i  PUSH  LL n  PUSH  LL m  MUL  JGE end  ...  JMP top
+//   ===>
+//   LL n  PUSH  LL m  MUL  SL t
+//   top: LL i  PUSH  LL t  JGE end  ...  JMP top
+//
+// a loop runs from the target of a jump back to the last such jump, and is
+// only entered at its top. the code goes before the top, where the jumps
+// from outside land and those back from inside do not. the values are found
+// as in ir_cse(), outer loops first so that they take what is invariant in
+// both.
+void ir_licm()
+{
+    int *back, *written, *push, *from, *to, *same, *tmp, *n, *m;
+    int h, j, i, k, b, op, lea, stores, nw, depth, start, count, ok;
+
+    if (ir[IrOp] != ENT) {
+        return;
+    }
+    back = ir_alloc(ir_count);
+    written = ir_alloc(ir_count);
+    push = ir_alloc(ir_count);
+    from = ir_alloc(ir_count);
+    to = ir_alloc(ir_count);
+    same = ir_alloc(ir_count);
+    tmp = ir_alloc(ir_count);
+    lea = 0;
+    i = 0;
+    while (i < ir_count) {
+        back[i] = -1;
+        i++;
+    }
+    i = 0;
+    while (i < ir_count) {
+        n = ir + i * IrSize;
+        lea = lea || n[IrOp] == LEA;
+        if (n[IrOp] >= 0 && op_target(n[IrOp]) >= 0 && n[IrTarget] <= i) {
+            back[n[IrTarget]] = i;
+        }
+        i++;
+    }
+
+    h = 1;
+    while (h < ir_count) {
+        j = back[h];
+        op = ir[h * IrSize + IrOp];
+        if (j < 0 || !(op == LL || op == IMM || op == LEA)) {
+            h++;
+            continue;
+        }
+
+        // entered only at the top, and what it stores and calls
+        ok = 1;
+        stores = 0;
+        nw = 0;
+        i = 0;
+        while (i < ir_count) {
+            n = ir + i * IrSize;
+            op = n[IrOp];
+            if (op >= 0 && op_target(op) >= 0 && (i < h || i > j) &&
+                n[IrTarget] > h && n[IrTarget] <= j) {
+                ok = 0;
+            }
+            // the nodes inserted before it, then it and those after it
+            m = (i > h && i <= j) ? (int *) n[IrBefore] : 0;
+            if (i < h || i > j) {
+                n = 0;
+            }
+            while (m || n) {
+                if (!m) {
+                    m = n;
+                    n = 0;
+                }
+                op = m[IrOp];
+                if (op == SL && nw == ir_count) {
+                    ok = 0;  // more stores than there is room to list
+                } else if (op == SL) {
+                    written[nw++] = m[IrArg];
+                    stores = stores || lea;
+                } else if (op >= 0 && !ir_pure(op) && op != ADJ &&
+                           op != LEV && op != JTAB && op_target(op) < 0) {
+                    stores = 1;
+                }
+                m = (int *) m[IrAfter];
+            }
+            i++;
+        }
+        if (!ok) {
+            h++;
+            continue;
+        }
+
+        // the largest invariant values
+        count = 0;
+        depth = 0;
+        start = -1;
+        b = -1;
+        i = h;
+        while (i <= j) {
+            n = ir + i * IrSize;
+            op = n[IrOp];
+            if (n[IrBlock] != b) {
+                b = n[IrBlock];
+                depth = 0;
+                start = -1;
+            }
+            if (op < 0) {
+                i++;
+                continue;
+            }
+            if (!ir_pure(op)) {
+                depth = 0;
+                start = -1;
+                i++;
+                continue;
+            }
+            if (op == PUSH) {
+                push[depth++] = start;
+                i++;
+                continue;
+            }
+            if (op == LL || op == IMM || op == LEA) {
+                start = i;
+            } else if ((op >= OR && op <= MOD) || (op >= LTU && op <= MODU) ||
+                       op == LIX || op == IDX) {
+                k = (depth > 0) ? push[--depth] : -1;
+                start = (start < 0) ? -1 : k;
+            }
+            if (start < 0 || ir_length(start, i) < 2) {
+                i++;
+                continue;
+            }
+
+            // loads only what the loop does not store, and may run before it
+            ok = 1;
+            k = start;
+            while (k <= i && ok) {
+                n = ir + k * IrSize;
+                if (n[IrOp] == LL) {
+                    ok = !(lea && stores);
+                    op = 0;
+                    while (op < nw && ok) {
+                        ok = written[op++] != n[IrArg];
+                    }
+                } else if (n[IrOp] == LI || n[IrOp] == LC || n[IrOp] == LCU ||
+                           n[IrOp] == LIX || n[IrOp] == LIO || n[IrOp] == LCO) {
+                    ok = !stores;
+                }
+                k++;
+            }
+            if (ok && (ir[start * IrSize + IrBlock] == ir[h * IrSize + IrBlock] ||
+                       ir_safe(start, i))) {
+                // in place of the values inside it
+                while (count > 0 && from[count - 1] >= start) {
+                    count--;
+                }
+                from[count] = start;
+                to[count] = i;
+                count++;
+            }
+            i++;
+        }
 
-                *++text = PUSH;
-                *++text = IMM;
-                *++text = (expr_type > PTR) ? sizeof(int) : sizeof(char);
-                *++text = (token == Inc) ? ADD : SUB;
-                *++text = (expr_type == CHAR) ? SC : SI;
-                *++text = PUSH;
-                *++text = IMM;
-                *++text = (expr_type > PTR) ? sizeof(int) : sizeof(char);
-                *++text = (token == Inc) ? SUB : ADD;
-                match(token);
-            } else if (token == Brak) {
-                // array access var[xx]
-                match(Brak);
-                *++text = PUSH;
-                expression(Assign);
-                match(']');
-
-                if (tmp > PTR) {
-                    // pointer, not `char *`
-                    *++text = PUSH;
-                    *++text = IMM;
-                    *++text = sizeof(int);
-                    *++text = MUL;
-                } else if (tmp < PTR) {
-                    printf("%d: pointer type expected\n", line);
-                    exit(-1);
+        // compute them before the top, the same ones into the same local
+        k = 0;
+        while (k < count) {
+            same[k] = k;
+            i = 0;
+            while (i < k && same[k] == k) {
+                if (ir_length(from[i], to[i]) == ir_length(from[k], to[k]) &&
+                    ir_same(from[i], from[k], ir_length(from[k], to[k]))) {
+                    same[k] = i;
                 }
-                expr_type = tmp - PTR;
-                *++text = ADD;
-                *++text = (expr_type == CHAR) ? LC : LI;
+                i++;
+            }
+            if (same[k] == k) {
+                tmp[k] = -++ir[IrArg];  // a new local slot
+                i = from[k];
+                while (i <= to[k]) {
+                    n = ir + i * IrSize;
+                    if (n[IrOp] >= 0) {
+                        ir_before(h, n[IrOp], n[IrArg]);
+                    }
+                    i++;
+                }
+                ir_before(h, SL, tmp[k]);
             } else {
-                printf("%d: compiler error, token = %d\n", line, token);
-                exit(-1);
+                tmp[k] = tmp[same[k]];
+            }
+            k++;
+        }
+        k = 0;
+        while (k < count) {
+            ir[from[k] * IrSize + IrOp] = LL;
+            ir[from[k] * IrSize + IrArg] = tmp[k];
+            i = from[k] + 1;
+            while (i <= to[k]) {
+                ir[i * IrSize + IrOp] = -1;
+                i++;
+            }
+            k++;
+        }
+        if (count > 0) {
+            i = h;
+            while (i <= j) {
+                n = ir + i * IrSize;
+                if (n[IrOp] >= 0 && op_target(n[IrOp]) >= 0 &&
+                    n[IrTarget] == h) {
+                    n[IrPast] = 1;
+                }
+                i++;
             }
         }
+        h++;
     }
 }
 
-void statement()
+// remove the loads of a local that ax holds already, after it was loaded or
+// stored and only pushed since
+void ir_loads()
 {
-    // there are 6 kinds of statements here:
-    // 1. if (...) <statement> [else <statement>]
-    // 2. while (...) <statement>
-    // 3. { <statement> }
-    // 4. return xxx;
-    // 5. <empty statement>;
-    // 6. expression; (expression end with semicolon)
+    int b, i, known, local, *n;
+
+    b = 0;
+    while (b < block_count) {
+        known = 0;
+        i = blocks[b * BSize + BFirst];
+        while (i < blocks[b * BSize + BEnd]) {
+            n = ir + i * IrSize;
+            while (n) {
+                if (n[IrOp] < 0 || n[IrOp] == PUSH) {
+                    // ax stays
+                } else if (n[IrOp] == LL && known && local == n[IrArg]) {
+                    n[IrOp] = -1;
+                } else if (n[IrOp] == LL || n[IrOp] == SL) {
+                    known = 1;
+                    local = n[IrArg];
+                } else {
+                    known = 0;
+                }
+                n = (int *) n[IrAfter];
+            }
+            i++;
+        }
+        b++;
+    }
+}
 
-    int *a, *b;  // bess for branch control
+// emit the chain of nodes from `n` on, jumps going to the node they
+// target, or past what is inserted before it, or to `end`
+void ir_emit(int *n, int *past, int end)
+{
+    int t;
+
+    while (n) {
+        if (n[IrOp] >= 0) {
+            *++text = n[IrOp];
+            lines[text - old_text] = n[IrLine];
+            t = op_target(n[IrOp]);
+            if (op_operands(n[IrOp]) > 0) {
+                *++text = n[IrArg];
+            }
+            if (op_operands(n[IrOp]) > 1) {
+                *++text = n[IrArg2];
+            }
+            if (t >= 0) {
+                text[t + 1 - op_operands(n[IrOp])] =
+                    (n[IrTarget] >= ir_count) ? end
+                    : n[IrPast]               ? past[n[IrTarget]]
+                                              : ir[n[IrTarget] * IrSize + IrText];
+            }
+        }
+        n = (int *) n[IrAfter];
+    }
+}
 
-    if (token == If) {
-        // if (...) <statement> [else <statement>]
-        //
-        //   if (<cond>)                   <cond>
-        //                                 JZ a
-        //     <true_statement>   ===>     <true_statement>
-        //   else:                         JMP b
-        // a:                           a:
-        //     <false_statement>           <false_statement>
-        // b:                           b:
+// size in text of the chain of nodes from `n` on
+int ir_chain_size(int *n)
+{
+    int size;
 
-        match(If);
-        match('(');
-        expression(Assign);  // parse condition
-        match(')');
+    size = 0;
+    while (n) {
+        if (n[IrOp] >= 0) {
+            size = size + 1 + op_operands(n[IrOp]);
+        }
+        n = (int *) n[IrAfter];
+    }
+    return size;
+}
 
+// lower the nodes back into text from `p` on
+void ir_lower(int *p)
+{
+    int i, end, *n, *past;
 
-        // emit code for JZ a
-        *++text = JZ;
-        b = ++text;
+    // where each node goes, with what is inserted before it, and past that.
+    // a removed one goes where what follows it does.
+    past = ir_alloc(ir_count);
+    i = 0;
+    while (i < ir_count) {
+        n = ir + i * IrSize;
+        n[IrText] = (int) p;
+        p = p + ir_chain_size((int *) n[IrBefore]);
+        past[i] = (int) p;
+        p = p + ir_chain_size(n);
+        i++;
+    }
+    end = (int) p;
 
-        statement();  // parse true statement
+    text = (int *) ir[IrText] - 1;
+    i = 0;
+    while (i < ir_count) {
+        n = ir + i * IrSize;
+        ir_emit((int *) n[IrBefore], past, end);
+        ir_emit(n, past, end);
+        i++;
+    }
+}
 
-        if (token == Else) {
-            match(Else);
+// optimize the function whose code is in text from `p` on: lift it into the
+// IR, run the passes on it and lower it back in place
+void ir_optimize(int *p)
+{
+    ir_lift(p, text + 1);
+    memset(lines + (p - old_text), 0, (text + 1 - p) * sizeof(int));
+    ir_thread();
+    ir_split();
+    ir_unreachable();
+    ir_licm();
+    ir_cse();
+    ir_loads();
+    ir_fall_through();
+    ir_lower(p);
+}
 
-            // emit code for JMP b
-            *++text = JMP;
-            *b = (int) (text + 2);
-            b = ++text;
+// compile the definition of function `id`, from its parameters on
+void function_definition(int *id)
+{
+    // the memory address of function
+    id[Value] = (int) (text + 1);
+    function_declaration(id);
+    if (opt_ir) {
+        ir_optimize((int *) id[Value]);
+    }
+    id[Size] = text + 1 - (int *) id[Value];
+    id[Params] = index_of_bp - 1;
+}
 
-            statement();  // parse false statement
+// skip the parameters and body of function `id` with a brace-matching skim,
+// its calls go to a LAZY stub that compiles it when it is first called.
+void function_skim(int *id)
+{
+    int depth, c;
+
+    id[Src] = (int) (src - 1);  // the '('
+    id[Line] = line;
+    id[Value] = (int) (text + 1);
+    *++text = LAZY;
+    *++text = (int) id;
+
+    // calls compiled before it need to know its long long parameters
+    next();
+    id[Wides] = function_parameter();
+    unwind_locals();
+
+    depth = 0;
+    while (*src) {
+        c = *src++;
+        if (c == '\n') {
+            line++;
+        } else if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            if (--depth == 0) {
+                break;
+            }
+        } else if (c == '"' || c == '\'') {
+            while (*src != 0 && *src != c) {
+                if (*src == '\\') {
+                    src++;
+                }
+                src++;
+            }
+            src++;
+        } else if (c == '#' || (c == '/' && *src == '/')) {
+            while (*src != 0 && *src != '\n') {
+                src++;
+            }
         }
+    }
+    token = '}';
+}
 
-        *b = (int) (text + 1);
-    } else if (token == While) {
-        // a:                       a:
-        //    while (<cond>)          <cond>
-        //                            JZ b
-        //     <statement>    ===>    <statement>
-        //                            JMP a
-        // b:                       b:
+void enum_declaration()
+{
+    // parse enum [id] { a = 1, b = 3, ... }
+    int i;
+    i = 0;
 
-        match(While);
-        a = text + 1;
-        match('(');
-        expression(Assign);
-        match(')');
+    while (token != '}') {
+        if (token != Id) {
+            printf("%d: bad enum identifier %d\n", line, token);
+            exit(-1);
+        }
+        match(Id);
 
-        // emit code for JZ b
-        *++text = JZ;
-        b = ++text;
+        if (token == Assign) {  // e.g. { a = 10 }
+            match(Assign);
+            if (token != Num) {
+                printf("%d: enum initializer\n", line);
+                exit(-1);
+            }
+            i = token_val;
+            match(Num);
+        }
 
-        statement();  // parse statement
+        current_id[Class] = Num;
+        current_id[Type] = INT;
+        current_id[Value] = i++;
 
-        // emit code for JMP a
-        *++text = JMP;
-        *++text = (int) a;
-        *b = (int) (text + 1);
-    } else if (token == Return) {
-        // return [expression];
-        match(Return);
+        if (token == ',') {
+            match(',');
+        }
+    }
+}
 
-        if (token != ';') {
-            expression(Assign);
+void global_declaration()
+{
+    // global_declaration ::= enum_decl | variable_decl | function_decl
+    //
+    // enum_decl ::= 'enum' [id] '{' id ['=' 'num'] {',' id ['=' 'num'} '}'
+    //
+    // variable_decl ::= type {'*'} id { ',' {'*'} id } ';'
+    //
+    // function_decl ::= type {'*'} id '(' parameter_decl ')' '{' body_decl '}'
+
+    int type;  // tmp, actual type for variable
+    int *id;
+
+    base_type = INT;
+
+    // parse enum, this should be treated alone.
+    if (token == Enum) {
+        // enum [id] {1 = 10, b = 26, ... }
+        match(Enum);
+        if (token != '{') {  // skip te [id] part
+            match(Id);
+        }
+        if (token == '{') {  // parse the assign part
+            match('{');
+            enum_declaration();
+            match('}');
         }
         match(';');
+        return;
+    }
 
-        // emit code for return
-        *++text = LEV;
-    } else if (token == '{') {
-        // { <statement> ... }
-        match('{');
-        while (token != '}') {
-            statement();
+    // parse type information
+    base_type = type_specifier(INT);
+
+    // parse the comma seperated variable declaration
+    while (token != ';' && token != '}') {
+        type = base_type;
+        // parse pointer type, note that there may exist `int ***x`
+        while (token == Mul) {
+            match(Mul);
+            type = type + PTR;
         }
-        match('}');
-    } else if (token == ';') {
-        // empty statement
-        match(';');
-    } else {
-        // `a= b;` or `function_call()`
-        expression(Assign);
-        match(';');
+
+        if (token != Id) {  // invalid declaration
+            printf("%d: bad global declaration\n", line);
+            exit(-1);
+        }
+        if (current_id[Class]) {  // identifier exists
+            printf("%d: duplicate global declaration\n", line);
+            exit(-1);
+        }
+        if (!type_size(type)) {
+            printf("%d: variable of incomplete struct type\n", line);
+            exit(-1);
+        }
+        match(Id);
+        current_id[Type] = type;
+
+        if (token == '(') {  // function declaration
+            if (is_struct(type)) {
+                printf("%d: struct return value, return a pointer to it\n",
+                       line);
+                exit(-1);
+            }
+            id = current_id;
+            id[Class] = Fun;
+            if (lazy) {
+                function_skim(id);
+            } else {
+                function_definition(id);
+            }
+        } else {  // variable declaration
+            current_id[Class] = Glo;
+            current_id[Value] = (int) data;
+            data = data + type_words(type) * sizeof(int);
+        }
+
+        if (token == ',') {
+            match(',');
+        }
+    }
+    next();
+}
+
+void program()
+{
+    // get next token
+    next();
+    while (token > 0) {
+        global_declaration();
+    }
+}
+
+// the function whose code `pc` is in, 0 if none
+int *code_function(int pc)
+{
+    int *id;
+
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun && !id[Src] &&
+            pc >= code_map[(int *) id[Value] - old_text] &&
+            pc < code_map[(int *) id[Value] + id[Size] - old_text]) {
+            return id;
+        }
+        id = id + IdSize;
+    }
+    return 0;
+}
+
+// the source line of the instruction before `pc` in the code of function
+// `id`, 0 if not known
+int code_line(int *id, int pc)
+{
+    int *p, *end, n;
+
+    p = (int *) id[Value];
+    end = p + id[Size];
+    n = 0;
+    while (p < end && code_map[p - old_text] < pc) {
+        n = lines[p - old_text] ? lines[p - old_text] : n;
+        p = p + 1 + op_operands(*p);
+    }
+    return n;
+}
+
+// does the instruction at `p` transfer control through its first operand
+int code_target(int *p)
+{
+    return op_target(*p) == 0 || *p == CALL || *p == TAIL || *p == FUN;
+}
+
+// does the first operand of the instruction at `p` need a WIDE prefix: in the
+// compact encoding it is a byte unless it is a code address.
+int wide(int *p)
+{
+    return !code_target(p) && (p[1] < -128 || p[1] > 127);
+}
+
+// size of the compact encoding of the instruction at `p`: a byte opcode and a
+// byte operand, words for code addresses and for operands that need them.
+int code_size(int *p)
+{
+    if (!op_operands(*p)) {
+        return 1;
     }
+    if (code_target(p)) {
+        return 1 + sizeof(int);
+    }
+    return (wide(p) ? 1 + sizeof(int) : 0) + 2 +
+           (op_operands(*p) - 1) * sizeof(int);
 }
 
-void function_parameter()
+// what the watchdog charges for the instruction at `q`, which a TICK then
+// precedes: the instructions of the loop that a backward jump closes, or one
+// for a call. 0 for the others, and for the JMPs of the table that follows a
+// JTAB, which must keep their size.
+int tick_charge(int *q, int table)
 {
-    int type;
-    int params;
-    params = 0;
+    int *r, n;
 
-    while (token != ')') {
-        // e.g. int name, ...
-        type = INT;
-        if (token == Int) {
-            match(Int);
-        } else if (token == Char) {
-            type = CHAR;
-            match(Char);
-        }
+    if (!watchdog || table) {
+        return 0;
+    }
+    if (*q == CALL || *q == TAIL) {
+        return 1;
+    }
+    if (op_target(*q) < 0 || (r = (int *) q[1 + op_target(*q)]) > q) {
+        return 0;
+    }
+    n = 0;
+    while (r <= q) {
+        n++;
+        r = r + 1 + op_operands(*r);
+    }
+    return n;
+}
 
-        // pointer type, e.g. int ****a
-        while (token == Mul) {
-            match(Mul);
-            type = type + PTR;
+// translate text from `p` to `end` into the code segment
+void assemble(int *p, int *end)
+{
+    int *q, op, v, i, table;
+    unsigned char *to;
+
+    // lay out the code first so that jump targets can be translated
+    to = code;
+    q = p;
+    table = 0;  // JMPs left in the table of a JTAB
+    while (q < end) {
+        code_map[q - old_text] = (int) to;
+        to = to + code_size(q) + (tick_charge(q, table) ? 1 + sizeof(int) : 0);
+        table = (*q == JTAB) ? q[1] + 1 : table - (table > 0);
+        q = q + 1 + op_operands(*q);
+    }
+    code_map[end - old_text] = (int) to;
+
+    while (p < end) {
+        op = *p;
+        i = 1;
+        if (code_map[p + 1 + op_operands(op) - old_text] -
+                code_map[p - old_text] >
+            code_size(p)) {  // laid out with a TICK
+            *code++ = TICK;
+            v = tick_charge(p, 0);
+            memcpy(code, &v, sizeof(int));
+            code = code + sizeof(int);
         }
-
-        // parameter name
-        if (token != Id) {  // invalid declaration
-            printf("%d: bad parameter declaration\n", line);
-            exit(-1);
+        if (!op_operands(op)) {
+            *code++ = op;
+        } else if (code_target(p)) {
+            *code++ = op;
+            i = 0;
+        } else if (wide(p)) {
+            *code++ = WIDE;
+            memcpy(code, p + 1, sizeof(int));
+            code = code + sizeof(int);
+            *code++ = op;
+            *code++ = 0;
+        } else {
+            *code++ = op;
+            *code++ = p[1];
         }
-        if (current_id[Class] == Loc) {  // identifier exists
-            printf("%d: duplicate parameter declaration\n", line);
-            exit(-1);
+        // code addresses
+        while (i++ < op_operands(op)) {
+            v = code_map[(int *) p[i] - old_text];
+            memcpy(code, &v, sizeof(int));
+            code = code + sizeof(int);
         }
-        match(Id);
+        p = p + 1 + op_operands(op);
+    }
+}
 
-        // store the parameter
-        current_id[BClass] = current_id[Class];
-        current_id[Class] = Loc;
-        current_id[BType] = current_id[Type];
-        current_id[Type] = type;
-        current_id[BValue] = current_id[Value];
-        current_id[Value] = params++;  // index of current parameter
+// allocate `n` bytes of the heap of the guest, which is never freed
+int alloc(int n)
+{
+    char *p;
 
-        if (token == ',') {
-            match(',');
+    n = (n + sizeof(int) - 1) & -sizeof(int);
+    do {  // the threads of parallel_for allocate too
+        p = heap;
+        if (n < 0 || n > heap_end - p) {
+            return 0;
         }
+    } while (!__sync_bool_compare_and_swap(&heap, p, p + n));
+    return (int) p;
+}
+
+// allocate a stack of `n` bytes from the heap, its lowest page a guard page
+// that a guest running off its end faults on. returns its lowest address, 0
+// if there is no room for it.
+int stack_alloc(int n)
+{
+    int p;
+
+    if (!(p = alloc(n + page_size))) {
+        return 0;
     }
+    p = (p + page_size - 1) & -page_size;
+    mprotect((void *) p, page_size, PROT_NONE);
+    return p;
+}
 
-    index_of_bp = params + 1;  // set index of bp pointer
+// set the protection of the guard pages of the stacks of the virtual machine,
+// PROT_NONE, or readable while a snapshot copies them
+void guard_stacks(int prot)
+{
+    int i;
+
+    mprotect(stack, page_size, prot);
+    i = 1;
+    while (co && i < CoMax) {
+        if (co[i * CoSize + CoStack]) {
+            mprotect((void *) co[i * CoSize + CoStack], page_size, prot);
+        }
+        i++;
+    }
+    i = 1;
+    while (pf_started && i < threads) {
+        mprotect((void *) pf_stacks[i], page_size, prot);
+        i++;
+    }
 }
 
-void function_body()
+// stack_overflow() cannot use stdio in a signal handler, so it builds its
+// message with these: append the `n` bytes at `s` to it at `*p`
+void msg_bytes(char **p, char *s, int n)
 {
-    // type func_name (...) {...}
-    //                   -->|   |<--
+    while (n-- > 0) {
+        *(*p)++ = *s++;
+    }
+}
 
-    // ... {
-    // 1. local declarations
-    // 2. statements
-    // }
+// and the string `s`
+void msg_str(char **p, char *s)
+{
+    while (*s) {
+        *(*p)++ = *s++;
+    }
+}
 
-    int type;
-    int pos_local;  // position of local variables on the stack
-    pos_local = index_of_bp;
+// and the decimal of `v`, which is not negative
+void msg_num(char **p, int v)
+{
+    char digits[16];
+    int n;
+
+    n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v = v / 10;
+    } while (v);
+    while (n > 0) {
+        *(*p)++ = digits[--n];
+    }
+}
 
-    while (token == Int || token == Char) {
-        // local variable declaration, just like global ones
-        base_type = (token == Int) ? INT : CHAR;
-        match(token);
+// SIGSEGV on a guard page is a guest stack overflow, reported with the
+// function that ran into it and the line it was called at, which the
+// innermost return address on the stack tells. other faults are the host's.
+// programs from the cache of a server have no symbols to name them with.
+void stack_overflow(int sig, siginfo_t *info, void *context)
+{
+    int i, guard, top, ret, fn, n, *p, *id, *caller;
+    unsigned char *stub;
+    char msg[256], *m, *name;
+
+    (void) sig;
+    (void) context;
+    guard = (int) info->si_addr & -page_size;
+    top = 0;
+    if (guard == (int) stack) {
+        top = (int) stack + pool_size;
+    }
+    i = 1;
+    while (co && i < CoMax) {
+        if (guard == co[i * CoSize + CoStack]) {
+            top = guard + CoStackSize;
+        }
+        i++;
+    }
+    i = 1;
+    while (pf_started && i < threads) {
+        if (guard == pf_stacks[i]) {
+            top = guard + pool_size;
+        }
+        i++;
+    }
+    if (!top) {
+        signal(SIGSEGV, SIG_DFL);  // fault again, and dump core
+        return;
+    }
 
-        while (token != ';') {
-            type = base_type;
-            while (token == Mul) {
-                match(Mul);
-                type = type + PTR;
+    // the word after a CALL, the target of which follows the opcode
+    p = (int *) (guard + page_size);
+    while (p < (int *) top &&
+           !(*p >= (int) old_code + 1 + (int) sizeof(int) && *p <= (int) code &&
+             *((unsigned char *) *p - 1 - sizeof(int)) == CALL)) {
+        p++;
+    }
+    id = caller = 0;
+    ret = 0;
+    if (p < (int *) top) {
+        ret = *p;
+        memcpy(&fn, (char *) ret - sizeof(int), sizeof(int));
+        // a call through a stub of -flazy: WIDE <id> LAZY 0, or a JMP to the
+        // function once it is patched
+        stub = (unsigned char *) fn;
+        if (*stub == WIDE && stub[1 + sizeof(int)] == LAZY) {
+            memcpy(&id, stub + 1, sizeof(int));
+        } else {
+            if (*stub == JMP) {
+                memcpy(&fn, stub + 1, sizeof(int));
             }
+            id = code_function(fn);
+        }
+        caller = code_function(ret);
+    }
 
-            if (token != Id) {  // invalid declaration
-                printf("%d: bad local declaration\n", line);
-                exit(-1);
-            }
-            if (current_id[Class] == Loc) {  // identifier exists
-                printf("%d: duplicate parameter declaration\n", line);
-                exit(-1);
-            }
-            match(Id);
+    m = msg;
+    msg_str(&m, "guest stack overflow");
+    if (id) {
+        msg_str(&m, " in ");
+        name = (char *) id[Name];
+        n = 0;
+        while (n < 64 && (char_class[name[n] & 255] & ClassIdent)) {
+            n++;
+        }
+        msg_bytes(&m, name, n);
+        msg_str(&m, "()");
+    }
+    if (caller && (n = code_line(caller, ret))) {
+        msg_str(&m, ", called at line ");
+        msg_num(&m, n);
+    }
+    msg_str(&m, "\n");
+    write(1, msg, m - msg);
+    _exit(-1);
+}
 
-            // store the local variable
-            current_id[BClass] = current_id[Class];
-            current_id[Class] = Loc;
-            current_id[BType] = current_id[Type];
-            current_id[Type] = type;
-            current_id[BValue] = current_id[Value];
-            current_id[Value] = ++pos_local;  // index of current local variable
+// write the state of the virtual machine to the image `path`: a header
+// with the registers, then the memory from the text segment to the end of
+// the heap in use. returns 0, and 1 when the program resumes from the image.
+int snapshot(char *path, unsigned char *pc, int *sp, int *bp)
+{
+    int fd, size, ok;
+    int hdr[SHeader];
+
+    size = (heap - (char *) old_text + page_size - 1) / page_size * page_size;
+    memset(hdr, 0, sizeof(hdr));
+    hdr[SMagic] = 0x6363696d;  // "micc"
+    hdr[SBase] = (int) old_text;
+    hdr[SSize] = size;
+    hdr[SOffset] = page_size;
+    hdr[SPool] = pool_size;
+    hdr[SHeapSize] = heap_size;
+    hdr[SPc] = (int) pc;
+    hdr[SSp] = (int) sp;
+    hdr[SBp] = (int) bp;
+    hdr[SAx] = 1;
+    hdr[SText] = (int) text;
+    hdr[SSymbols] = (int) sym_top;
+    hdr[SCode] = (int) code;
+    hdr[SData] = (int) data;
+    hdr[SHeap] = (int) heap;
+    hdr[SOpt] = opt_level;
+    hdr[SInline] = inline_limit;
+    hdr[SLazy] = lazy;
+    hdr[SIr] = opt_ir;
+    hdr[SMain] = (int) idmain;
+    hdr[SCo] = (int) co;
+    hdr[SCoCur] = co_cur;
+    hdr[SCoHead] = co_head;
+    hdr[SCoTail] = co_tail;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return -1;
+    }
+    guard_stacks(PROT_READ | PROT_WRITE);  // for write() to read them
+    ok = write(fd, hdr, sizeof(hdr)) == (int) sizeof(hdr) &&
+         lseek(fd, page_size, SEEK_SET) == page_size &&
+         write(fd, old_text, size) == size;
+    guard_stacks(PROT_NONE);
+    close(fd);
+    return ok ? 0 : -1;
+}
 
-            if (token == ',') {
-                match(',');
-            }
+// add coroutine `i` to the end of the ready queue
+void co_queue(int i)
+{
+    co[i * CoSize + CoNext] = -1;
+    if (co_tail < 0) {
+        co_head = i;
+    } else {
+        co[co_tail * CoSize + CoNext] = i;
+    }
+    co_tail = i;
+}
+
+// start a coroutine running function `f` (a code address) with argument
+// `arg`, on a stack of its own. it returns to DONE at the start of the
+// code. returns its number, or -1 if there is no room for it.
+int spawn(int f, int arg)
+{
+    int i, *c, *sp;
+
+    if (!co) {  // the first one, the program itself is coroutine 0
+        if (!(co = (int *) alloc(CoMax * CoSize * sizeof(int)))) {
+            return -1;
         }
+        co[CoState] = CoReady;
+        co_head = co_tail = -1;
+    }
+    i = 1;
+    while (i < CoMax && co[i * CoSize + CoState] != CoFree) {
+        i++;
+    }
+    if (i == CoMax) {
+        return -1;
+    }
+    c = co + i * CoSize;
+    if (!c[CoStack] && !(c[CoStack] = stack_alloc(CoStackSize))) {
+        return -1;
+    }
+    sp = (int *) (c[CoStack] + CoStackSize);
+    *--sp = arg;
+    *--sp = (int) old_code;
+    c[CoPc] = f;
+    c[CoSp] = c[CoBp] = (int) sp;
+    c[CoAx] = 0;
+    c[CoState] = CoReady;
+    c[CoJoin] = -1;
+    co_queue(i);
+    return i;
+}
 
-        match(';');
+// milliseconds of the monotonic clock, from about the first call
+int now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if (!io_epoch) {
+        io_epoch = t.tv_sec;
     }
+    return (t.tv_sec - io_epoch) * 1000 + t.tv_nsec / 1000000;
+}
 
-    // save the stack size for local variables
-    *++text = ENT;
-    *++text = pos_local - index_of_bp;
+// park the running coroutine until file `fd` is ready for `events`, or
+// `timeout` ms have passed if it is not -1. when it wakes up, the syscall
+// that parked it runs again, or returns 0 if it timed out. returns 0 if
+// it cannot be parked, e.g. because another coroutine waits on `fd`.
+int io_park(int fd, int events, int timeout)
+{
+    struct epoll_event ev;
+    int *c;
 
-    // statements
-    while (token != '}') {
-        statement();
+    if (!io_ep && (io_ep = epoll_create1(0)) < 0) {
+        io_ep = 0;
+        return 0;
+    }
+    ev.events = events;
+    ev.data.u64 = 0;
+    ev.data.fd = co_cur;
+    if (epoll_ctl(io_ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return 0;
     }
+    c = co + co_cur * CoSize;
+    c[CoState] = CoIo;
+    c[CoFd] = fd;
+    c[CoWake] = (timeout < 0) ? -1 : now() + timeout;
+    io_parked++;
+    return 1;
+}
 
-    // emit code for leaving the sub function
-    *++text = LEV;
+// make parked coroutine `i` ready, to run its syscall again or, if it
+// `timed_out`, to return 0 from it
+void io_wake(int i, int timed_out)
+{
+    int *c;
+
+    c = co + i * CoSize;
+    epoll_ctl(io_ep, EPOLL_CTL_DEL, c[CoFd], 0);
+    if (timed_out) {
+        c[CoPc] = c[CoPc] + 1;
+        c[CoAx] = 0;
+    }
+    c[CoState] = CoReady;
+    co_queue(i);
+    io_parked--;
 }
 
-void function_declaration()
+// wait until some coroutine parked on I/O can run, or just look if not
+// `block`, and queue those that can. returns 0 if none is parked.
+int io_wait(int block)
 {
-    // type func_name (...) {...}
-    //               | this part
+    struct epoll_event ev[16];
+    int i, n, t, timeout;
+    int *c;
 
-    match('(');
-    function_parameter();
-    match(')');
-    match('{');
-    function_body();
-    // match('}');  // remain math('}') to global_declaration()
+    if (!io_parked) {
+        return 0;
+    }
 
-    // unwind local variable declarations for all local variables
-    current_id = symbols;
-    while (current_id[Token]) {
-        if (current_id[Class] == Loc) {
-            current_id[Class] = current_id[BClass];
-            current_id[Type] = current_id[BType];
-            current_id[Value] = current_id[BValue];
+    // wait no longer than the nearest timeout
+    timeout = -1;
+    i = 0;
+    while (i < CoMax) {
+        c = co + i * CoSize;
+        if (c[CoState] == CoIo && c[CoWake] >= 0) {
+            t = c[CoWake] - now();
+            t = (t < 0) ? 0 : t;
+            timeout = (timeout < 0 || t < timeout) ? t : timeout;
         }
-        current_id = current_id + IdSize;
+        i++;
     }
+
+    n = epoll_wait(io_ep, ev, 16, block ? timeout : 0);
+    i = 0;
+    while (i < n) {
+        io_wake(ev[i].data.fd, 0);
+        i++;
+    }
+    i = 0;
+    while (i < CoMax) {
+        c = co + i * CoSize;
+        if (c[CoState] == CoIo && c[CoWake] >= 0 && c[CoWake] <= now()) {
+            io_wake(i, 1);
+        }
+        i++;
+    }
+    return 1;
 }
 
-void enum_declaration()
+// epoll_ctl() for the guest, which names the file instead of passing data
+int poll_ctl(int ep, int op, int fd, int events)
 {
-    // parse enum [id] { a = 1, b = 3, ... }
-    int i;
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    return epoll_ctl(ep, op, fd, &ev);
+}
+
+// epoll_wait() for the guest, which gets pairs of events and file in `out`
+int poll_wait(int ep, int *out, int max, int timeout)
+{
+    struct epoll_event ev[64];
+    int i, n;
+
+    n = epoll_wait(ep, ev, (max < 64) ? max : 64, timeout);
     i = 0;
+    while (i < n) {
+        out[2 * i] = ev[i].events;
+        out[2 * i + 1] = ev[i].data.fd;
+        i++;
+    }
+    return n;
+}
 
-    while (token != '}') {
-        if (token != Id) {
-            printf("%d: bad enum identifier %d\n", line, token);
-            exit(-1);
+// pipe() for the guest
+int guest_pipe(int *fds)
+{
+    int p[2];
+
+    if (pipe(p) < 0) {
+        return -1;
+    }
+    fds[0] = p[0];
+    fds[1] = p[1];
+    return 0;
+}
+
+// save the registers of the running coroutine, queue it again if `ready`,
+// and return the coroutine to run next, 0 if there is none.
+int *co_switch(unsigned char *pc, int *sp, int *bp, int ax, int ready)
+{
+    int *c;
+
+    c = co + co_cur * CoSize;
+    c[CoPc] = (int) pc;
+    c[CoSp] = (int) sp;
+    c[CoBp] = (int) bp;
+    c[CoAx] = ax;
+    if (ready) {
+        co_queue(co_cur);
+    }
+    while (co_head < 0) {
+        if (!io_wait(1)) {
+            return 0;
         }
-        match(Id);
+    }
+    co_cur = co_head;
+    c = co + co_cur * CoSize;
+    co_head = c[CoNext];
+    if (co_head < 0) {
+        co_tail = -1;
+    }
+    return c;
+}
 
-        if (token == Assign) {  // e.g. { a = 10 }
-            match(Assign);
-            if (token != Num) {
-                printf("%d: enum initializer\n", line);
-                exit(-1);
-            }
-            i = token_val;
-            match(Num);
+// compile function `id` on its first call, which went to its LAZY `stub`
+// and returns to `ret`. returns the address of the code.
+unsigned char *lazy_compile(int *id, unsigned char *stub, unsigned char *ret)
+{
+    int to, old;
+    unsigned char *site;
+
+    // threads of a parallel_for call through stubs that are not patched.
+    // not through Value: a thread compiling a function shadows the Value of
+    // the symbols its locals are named by.
+    if (parallel && (to = __atomic_load_n(&id[Code], __ATOMIC_ACQUIRE))) {
+        return (unsigned char *) to;
+    }
+
+    pthread_mutex_lock(&compile_lock);
+    if (id[Src]) {  // not compiled by another thread meanwhile
+        src = (char *) id[Src];
+        line = id[Line];
+        next();
+        function_definition(id);
+        assemble((int *) id[Value], text + 1);
+        __atomic_store_n(&id[Code], code_map[(int *) id[Value] - old_text],
+                         __ATOMIC_RELEASE);
+        id[Src] = 0;
+    }
+    to = id[Code];
+
+    // later calls through the stub jump to the code, and a call site that
+    // got us here calls it directly. not while other threads may be
+    // decoding them.
+    if (!parallel) {
+        *stub = JMP;
+        memcpy(stub + 1, &to, sizeof(int));
+        site = ret - 1 - sizeof(int);
+        old = (int) stub;
+        if (site >= old_code && *site == CALL &&
+            !memcmp(site + 1, &old, sizeof(int))) {
+            memcpy(site + 1, &to, sizeof(int));
         }
+    }
+    pthread_mutex_unlock(&compile_lock);
+    return (unsigned char *) to;
+}
 
-        current_id[Class] = Num;
-        current_id[Type] = INT;
-        current_id[Value] = i++;
+int eval(unsigned char *pc, int *sp, int *bp, int ax);
 
-        if (token == ',') {
-            match(',');
+// end the parallel_for with exit `status`, unless another call already did
+void pf_exit(int status)
+{
+    if (__sync_bool_compare_and_swap(&pf_exited, 0, 1)) {
+        pf_status = status;
+    }
+}
+
+// run function `fn` (a code address) for each index from `i` to `end`, on
+// the stack below `top`. a call that ends the program instead of returning,
+// e.g. by exit(), ends the parallel_for.
+void pf_call(int fn, int i, int end, int *top)
+{
+    int *sp, status;
+
+    while (i < end && !__atomic_load_n(&pf_exited, __ATOMIC_ACQUIRE)) {
+        sp = top;
+        *--sp = 0;  // set by STOP once fn has returned
+        *--sp = i;
+        *--sp = (int) (old_code + 1);  // STOP
+        status = eval((unsigned char *) fn, sp, sp, 0);
+        if (!top[-1]) {
+            pf_exit(status);
         }
+        i++;
     }
 }
 
-void global_declaration()
+// run chunks of the parallel_for until none is left, each thread claims
+// the next one when it is done with its own.
+void pf_chunks(int *top)
 {
-    // global_declaration ::= enum_decl | variable_decl | function_decl
-    //
-    // enum_decl ::= 'enum' [id] '{' id ['=' 'num'] {',' id ['=' 'num'} '}'
-    //
-    // variable_decl ::= type {'*'} id { ',' {'*'} id } ';'
-    //
-    // function_decl ::= type {'*'} id '(' parameter_decl ')' '{' body_decl '}'
+    int i;
 
-    int type;  // tmp, actual type for variable
+    while (!__atomic_load_n(&pf_exited, __ATOMIC_ACQUIRE) &&
+           (i = __sync_fetch_and_add(&pf_next, pf_chunk)) < pf_hi) {
+        pf_call(pf_fn, i, (pf_hi - i > pf_chunk) ? i + pf_chunk : pf_hi, top);
+    }
+}
 
-    base_type = INT;
+// a thread of the pool, running parallel_fors on its `stack`
+void *pf_thread(void *stack)
+{
+    while (1) {
+        pthread_barrier_wait(&pf_start);
+        pf_chunks((int *) stack);
+        pthread_barrier_wait(&pf_end);
+    }
+    return 0;
+}
 
-    // parse enum, this should be treated alone.
-    if (token == Enum) {
-        // enum [id] {1 = 10, b = 26, ... }
-        match(Enum);
-        if (token != '{') {  // skip te [id] part
-            match(Id);
-        }
-        if (token == '{') {  // parse the assign part
-            match('{');
-            enum_declaration();
-            match('}');
-        }
-        match(';');
-        return;
+// run `fn` for each index from `lo` to `hi` on the threads of the pool and
+// ours, whose stack is below `sp`. returns 0 once all calls have returned,
+// or 1 once they have stopped because one ended the program with
+// pf_status.
+int parallel_for(int fn, int lo, int hi, int *sp)
+{
+    int i, stack;
+    pthread_t t;
+
+    if (!parallel) {
+        pf_exited = 0;
+    }
+    if (parallel || threads < 2) {  // nested, or a single thread
+        pf_call(fn, lo, hi, sp);
+        return __atomic_load_n(&pf_exited, __ATOMIC_ACQUIRE);
+    }
+    if (!pf_started) {
+        pthread_barrier_init(&pf_start, 0, threads);
+        pthread_barrier_init(&pf_end, 0, threads);
+        pf_stacks = (int *) alloc(threads * sizeof(int));
+        i = 1;
+        while (i < threads) {
+            if (!pf_stacks ||
+                !(stack = pf_stacks[i] = stack_alloc(pool_size)) ||
+                pthread_create(&t, 0, pf_thread,
+                               (void *) (stack + pool_size))) {
+                printf("could not start the threads of parallel_for\n");
+                exit(-1);
+            }
+            i++;
+        }
+        pf_started = 1;
     }
 
-    // parse type information
-    if (token == Int) {
-        match(Int);
-    } else if (token == Char) {
-        match(Char);
-        base_type = CHAR;
-    }
+    pf_fn = fn;
+    pf_next = lo;
+    pf_hi = hi;
+    pf_chunk = (hi - lo) / (threads * 8);
+    pf_chunk = (pf_chunk < 1) ? 1 : pf_chunk;
+    parallel = 1;
+    pthread_barrier_wait(&pf_start);
+    pf_chunks(sp);
+    pthread_barrier_wait(&pf_end);
+    parallel = 0;
+    return pf_exited;
+}
 
-    // parse the comma seperated variable declaration
-    while (token != ';' && token != '}') {
-        type = base_type;
-        // parse pointer type, note that there may exist `int ***x`
-        while (token == Mul) {
-            match(Mul);
-            type = type + PTR;
-        }
+// SIGALRM of --timeout
+void watchdog_alarm(int sig)
+{
+    (void) sig;
+    expired = 1;
+}
 
-        if (token != Id) {  // invalid declaration
-            printf("%d: bad global declaration\n", line);
-            exit(-1);
-        }
-        if (current_id[Class]) {  // identifier exists
-            printf("%d: duplicate global declaration\n", line);
-            exit(-1);
-        }
-        match(Id);
-        current_id[Type] = type;
+// report where the watchdog stopped the guest, at `pc`, and return the exit
+// status for it. the threads of a parallel_for all run out, the first of
+// them reports it and ends the parallel_for with it.
+int watchdog_stop(unsigned char *pc)
+{
+    int status, *id;
 
-        if (token == '(') {  // function declaration
-            current_id[Class] = Fun;
-            // the memory address of function
-            current_id[Value] = (int) (text + 1);
-            function_declaration();
-        } else {  // variable declaration
-            current_id[Class] = Glo;
-            current_id[Value] = (int) data;
-            data = data + sizeof(int);
+    status = expired ? StopTimeout : StopBudget;
+    if (parallel && !__sync_bool_compare_and_swap(&pf_exited, 0, 1)) {
+        return status;
+    }
+    printf(expired ? "timeout" : "instruction limit reached");
+    if ((id = code_function((int) pc))) {
+        printf(" in ");
+        print_name(id);
+        printf("()");
+        if (code_line(id, (int) pc)) {
+            printf(" at line %d", code_line(id, (int) pc));
         }
+    }
+    printf("\n");
+    if (parallel) {
+        pf_status = status;
+    }
+    return status;
+}
 
-        if (token == ',') {
-            match(',');
-        }
+// `a` <op> `b` for long long operator `op`, 0 or 1 for a comparison. a shift
+// count is only the low bits of `b`.
+unsigned long long op64(int op, unsigned long long a, unsigned long long b)
+{
+    if (op == OR64) {
+        return a | b;
+    } else if (op == XOR64) {
+        return a ^ b;
+    } else if (op == AND64) {
+        return a & b;
+    } else if (op == EQ64) {
+        return a == b;
+    } else if (op == NE64) {
+        return a != b;
+    } else if (op == LT64) {
+        return (long long) a < (long long) b;
+    } else if (op == GT64) {
+        return (long long) a > (long long) b;
+    } else if (op == LE64) {
+        return (long long) a <= (long long) b;
+    } else if (op == GE64) {
+        return (long long) a >= (long long) b;
+    } else if (op == SHL64) {
+        return a << (b & 63);
+    } else if (op == SHR64) {
+        return (long long) a >> (b & 63);
+    } else if (op == ADD64) {
+        return a + b;
+    } else if (op == SUB64) {
+        return a - b;
+    } else if (op == MUL64) {
+        return a * b;
+    } else if (op == DIV64) {
+        return (long long) a / (long long) b;
+    } else if (op == MOD64) {
+        return (long long) a % (long long) b;
+    } else if (op == LTU64) {
+        return a < b;
+    } else if (op == GTU64) {
+        return a > b;
+    } else if (op == LEU64) {
+        return a <= b;
+    } else if (op == GEU64) {
+        return a >= b;
+    } else if (op == SHRU64) {
+        return a >> (b & 63);
+    } else if (op == DIVU64) {
+        return a / b;
     }
-    next();
+    return a % b;
 }
 
-void program()
+// touch the frame of `n` words below `bp` a probe apart from the top down,
+// to run into the guard page below the stack rather than past it. ENT does
+// it with the final size of the frame, which inlined calls and the passes
+// of the IR add slots to after its function is parsed.
+void stack_probe(int *bp, int n)
 {
-    // get next token
-    next();
-    while (token > 0) {
-        global_declaration();
+    int i;
+
+    i = 0;
+    while (i < n) {
+        i = i + StackProbe / sizeof(int);
+        i = (i < n) ? i : n;
+        *(volatile int *) (bp - i);
     }
 }
 
-int eval()
+int eval(unsigned char *pc, int *sp, int *bp, int ax)
 {
-    int op, *tmp;
+    // the virtual machine registers are kept in locals, so the host compiler
+    // can hold them (and `ax`, the cached top of stack) in host registers.
+    // `hx` is the high word of a long long in ax.
+    int op, v, w, t, hx, *tmp;
+    unsigned long long c;
+
+    w = 0;
+    hx = 0;
     while (1) {
         op = *pc++;  // get next operation code
-
-        if (op == IMM) {  // load immediate value
-            ax = *pc++;
+        v = w + (signed char) *pc;  // and its operand, if it has one
+        w = 0;
+
+        // the most frequent instructions come first
+        if (op == LL) {  // load local, ax = bp[imm]
+            ax = bp[v];
+            pc++;
+        } else if (op == SL) {  // save ax to local
+            bp[v] = ax;
+            pc++;
+        } else if (op == IMM) {  // load immediate value
+            ax = v;
+            pc++;
         } else if (op == LC) {  // load character to ax, address in ax
             ax = *(char *) ax;
+        } else if (op == LCU) {  // load unsigned character, zero-extended
+            ax = *(unsigned char *) ax;
         } else if (op == LI) {  // load integer to ax, address in ax
             ax = *(int *) ax;
         } else if (op == SC) {  // save character to address, value in ax,
@@ -1216,29 +4776,118 @@ int eval()
         } else if (op == SI) {  // save integer to address, value in ax, address
                                 // on stack
             *(int *) (*sp++) = ax;
+        } else if (op == LIX) {  // load integer at index ax of array on stack
+            ax = ((int *) *sp++)[ax];
+        } else if (op == SIX) {  // save integer to index of array, value in ax,
+                                 // array and index on stack
+            ((int *) sp[1])[sp[0]] = ax;
+            sp = sp + 2;
+        } else if (op == IDX) {  // address of index ax of array on stack
+            ax = (int) ((int *) *sp++ + ax);
+        } else if (op == LIO) {  // load integer at offset imm of address in ax
+            ax = *(int *) (ax + v);
+            pc++;
+        } else if (op == LCO) {
+            ax = *(char *) (ax + v);
+            pc++;
+        } else if (op == SIO) {  // save integer at offset imm of address on
+                                 // stack, value in ax
+            *(int *) (*sp++ + v) = ax;
+            pc++;
+        } else if (op == SCO) {
+            *(char *) (*sp++ + v) = ax;
+            pc++;
         } else if (op == PUSH) {  // push the value of ax onto the stack
             *--sp = ax;
         } else if (op == JMP) {  // jump to the address
-            pc = (int *) *pc;
+            memcpy(&t, pc, sizeof(int));
+            pc = (unsigned char *) t;
+        } else if (op == JTAB) {  // jump through entry ax of the JMPs that
+                                  // follow, the last one if it is out of range
+            t = ((unsigned) ax < (unsigned) v) ? ax : v;
+            memcpy(&t, pc + 1 + t * (1 + sizeof(int)) + 1, sizeof(int));
+            pc = (unsigned char *) t;
         } else if (op == JZ) {  // jump if ax is zero
-            pc = ax ? (pc + 1) : ((int *) *pc);
+            memcpy(&t, pc, sizeof(int));
+            pc = ax ? pc + sizeof(int) : (unsigned char *) t;
         } else if (op == JNZ) {  // jump if ax is not zero
-            pc = ax ? ((int *) *pc) : (pc + 1);
+            memcpy(&t, pc, sizeof(int));
+            pc = ax ? (unsigned char *) t : pc + sizeof(int);
+        } else if (op == JEQ) {  // compare stack top with ax and jump
+            memcpy(&t, pc, sizeof(int));
+            pc = (*sp++ == ax) ? (unsigned char *) t : pc + sizeof(int);
+        } else if (op == JNE) {
+            memcpy(&t, pc, sizeof(int));
+            pc = (*sp++ != ax) ? (unsigned char *) t : pc + sizeof(int);
+        } else if (op == JLT) {
+            memcpy(&t, pc, sizeof(int));
+            pc = (*sp++ < ax) ? (unsigned char *) t : pc + sizeof(int);
+        } else if (op == JGT) {
+            memcpy(&t, pc, sizeof(int));
+            pc = (*sp++ > ax) ? (unsigned char *) t : pc + sizeof(int);
+        } else if (op == JLE) {
+            memcpy(&t, pc, sizeof(int));
+            pc = (*sp++ <= ax) ? (unsigned char *) t : pc + sizeof(int);
+        } else if (op == JGE) {
+            memcpy(&t, pc, sizeof(int));
+            pc = (*sp++ >= ax) ? (unsigned char *) t : pc + sizeof(int);
+        } else if (op == JEQI) {  // compare ax with imm and jump
+            memcpy(&t, pc + 1, sizeof(int));
+            pc = (ax == v) ? (unsigned char *) t : pc + 1 + sizeof(int);
+        } else if (op == JNEI) {
+            memcpy(&t, pc + 1, sizeof(int));
+            pc = (ax != v) ? (unsigned char *) t : pc + 1 + sizeof(int);
+        } else if (op == JLTI) {
+            memcpy(&t, pc + 1, sizeof(int));
+            pc = (ax < v) ? (unsigned char *) t : pc + 1 + sizeof(int);
+        } else if (op == JGTI) {
+            memcpy(&t, pc + 1, sizeof(int));
+            pc = (ax > v) ? (unsigned char *) t : pc + 1 + sizeof(int);
+        } else if (op == JLEI) {
+            memcpy(&t, pc + 1, sizeof(int));
+            pc = (ax <= v) ? (unsigned char *) t : pc + 1 + sizeof(int);
+        } else if (op == JGEI) {
+            memcpy(&t, pc + 1, sizeof(int));
+            pc = (ax >= v) ? (unsigned char *) t : pc + 1 + sizeof(int);
         } else if (op == CALL) {  // call subroutine
-            *--sp = (int) (pc + 1);
-            pc = (int *) *pc;
+            memcpy(&t, pc, sizeof(int));
+            *--sp = (int) (pc + sizeof(int));
+            pc = (unsigned char *) t;
+        } else if (op == TARG) {  // move tail call arguments over ours
+            pc++;
+            while (v-- > 0) {
+                bp[2 + v] = sp[v];
+            }
+        } else if (op == TAIL) {  // drop our frame and jump to subroutine
+            sp = bp;
+            bp = (int *) *sp++;
+            memcpy(&t, pc, sizeof(int));
+            pc = (unsigned char *) t;
+        } else if (op == FUN) {  // load the address of a function
+            memcpy(&ax, pc, sizeof(int));
+            pc = pc + sizeof(int);
+        } else if (op == LAZY) {  // compile the function called, and enter it
+            // the stub is WIDE <id> LAZY 0
+            pc = lazy_compile((int *) v, pc - 2 - sizeof(int),
+                              (unsigned char *) *sp);
         } else if (op == ENT) {  // make new stack frame
             *--sp = (int) bp;
             bp = sp;
-            sp = sp - *pc++;
+            sp = sp - v;
+            pc++;
+            if (v > StackProbe / (int) sizeof(int)) {
+                stack_probe(bp, v);
+            }
         } else if (op == ADJ) {  // add esp, <size>
-            sp = sp + *pc++;
+            sp = sp + v;
+            pc++;
         } else if (op == LEV) {  // restore call frame and PC
             sp = bp;
             bp = (int *) *sp++;
-            pc = (int *) *sp++;
+            pc = (unsigned char *) *sp++;
         } else if (op == LEA) {  // load address for arguments.
-            ax = *(bp + *pc++);
+            ax = (int) (bp + v);
+            pc++;
         } else if (op == OR) {
             ax = *sp++ | ax;
         } else if (op == XOR) {
@@ -1271,6 +4920,126 @@ int eval()
             ax = *sp++ / ax;
         } else if (op == MOD) {
             ax = *sp++ % ax;
+        } else if (op == ORI) {  // <op>I: ax = ax <op> imm
+            ax = ax | v;
+            pc++;
+        } else if (op == XORI) {
+            ax = ax ^ v;
+            pc++;
+        } else if (op == ANDI) {
+            ax = ax & v;
+            pc++;
+        } else if (op == EQI) {
+            ax = ax == v;
+            pc++;
+        } else if (op == NEI) {
+            ax = ax != v;
+            pc++;
+        } else if (op == LTI) {
+            ax = ax < v;
+            pc++;
+        } else if (op == GTI) {
+            ax = ax > v;
+            pc++;
+        } else if (op == LEI) {
+            ax = ax <= v;
+            pc++;
+        } else if (op == GEI) {
+            ax = ax >= v;
+            pc++;
+        } else if (op == SHLI) {
+            ax = ax << v;
+            pc++;
+        } else if (op == SHRI) {
+            ax = ax >> v;
+            pc++;
+        } else if (op == ADDI) {
+            ax = ax + v;
+            pc++;
+        } else if (op == SUBI) {
+            ax = ax - v;
+            pc++;
+        } else if (op == MULI) {
+            ax = ax * v;
+            pc++;
+        } else if (op == DIVI) {
+            ax = ax / v;
+            pc++;
+        } else if (op == MODI) {
+            ax = ax % v;
+            pc++;
+        } else if (op == DIVP) {  // ax / (1 << imm), rounding towards zero
+            ax = (ax < 0 ? ax + (1 << v) - 1 : ax) >> v;
+            pc++;
+        } else if (op == MODP) {  // ax % (1 << imm)
+            v = (1 << v) - 1;
+            pc++;
+            ax = (ax < 0 && (ax & v)) ? (ax & v) - v - 1 : ax & v;
+        } else if (op == SHRUI) {
+            ax = (unsigned) ax >> v;
+            pc++;
+        } else if (op == LTU) {  // <op>U: unsigned forms
+            ax = (unsigned) *sp++ < (unsigned) ax;
+        } else if (op == GTU) {
+            ax = (unsigned) *sp++ > (unsigned) ax;
+        } else if (op == LEU) {
+            ax = (unsigned) *sp++ <= (unsigned) ax;
+        } else if (op == GEU) {
+            ax = (unsigned) *sp++ >= (unsigned) ax;
+        } else if (op == SHRU) {
+            ax = (unsigned) *sp++ >> ax;
+        } else if (op == DIVU) {
+            ax = (unsigned) *sp++ / (unsigned) ax;
+        } else if (op == MODU) {
+            ax = (unsigned) *sp++ % (unsigned) ax;
+        } else if (op == LI64) {  // load long long to hx:ax, address in ax
+            hx = ((int *) ax)[1];
+            ax = *(int *) ax;
+        } else if (op == SI64) {  // save hx:ax to address on stack
+            tmp = (int *) *sp++;
+            tmp[0] = ax;
+            tmp[1] = hx;
+        } else if (op == PUSH64) {  // push hx:ax, the low word on top
+            *--sp = hx;
+            *--sp = ax;
+        } else if (op == IMMH) {  // load immediate to hx, the high word of a
+                                  // long long
+            hx = v;
+            pc++;
+        } else if (op == SX64) {  // sign-extend ax to hx:ax
+            hx = (ax < 0) ? -1 : 0;
+        } else if (op == ZX64) {
+            ax = (unsigned) ax;
+            hx = 0;
+        } else if (op == SXS) {  // sign-extend the word on the stack to two
+            t = *sp;
+            *sp = (t < 0) ? -1 : 0;
+            *--sp = t;
+        } else if (op == ZXS) {
+            t = (unsigned) *sp;
+            *sp = 0;
+            *--sp = t;
+        } else if (op == NZ64) {  // is hx:ax not 0
+            ax = ax != 0 || hx != 0;
+        } else if (op >= OR64 && op <= MODU64) {  // <op>64: the long long on
+                                                  // the stack <op> hx:ax
+            c = op64(op, (unsigned long long) sp[1] << 32 | (unsigned) sp[0],
+                     (unsigned long long) hx << 32 | (unsigned) ax);
+            sp = sp + 2;
+            hx = (int) (c >> 32);
+            ax = (int) c;
+        } else if (op == WIDE) {  // a word to add to the next operand
+            memcpy(&w, pc, sizeof(int));
+            pc = pc + sizeof(int);
+        } else if (op == TICK) {  // charge the backward jump or call that
+                                  // follows, and stop once out of budget
+            memcpy(&t, pc, sizeof(int));
+            pc = pc + sizeof(int);
+            if ((parallel ? __atomic_sub_fetch(&budget, t, __ATOMIC_RELAXED)
+                          : (budget = budget - t)) < 0 ||
+                expired) {  // the threads of a parallel_for share the budget
+                return watchdog_stop(pc);
+            }
         } else if (op == EXIT) {
             printf("exit(%d)\n", *sp);
             return *sp;
@@ -1278,18 +5047,120 @@ int eval()
             ax = open((char *) sp[1], sp[0]);
         } else if (op == CLOS) {
             ax = close(*sp);
-        } else if (op == READ) {
-            ax = read(sp[2], (char *) sp[1], sp[0]);
+        } else if (op == READ || op == WRIT) {
+            ax = (op == READ) ? read(sp[2], (char *) sp[1], sp[0])
+                              : write(sp[2], (char *) sp[1], sp[0]);
+            if (ax < 0 && errno == EINTR && expired) {  // by --timeout
+                return watchdog_stop(pc);
+            }
+            // with coroutines, one that would block parks and the next runs
+            if (ax < 0 && errno == EAGAIN && co && !parallel &&
+                io_park(sp[2], (op == READ) ? EPOLLIN : EPOLLOUT, -1)) {
+                tmp = co_switch(pc - 1, sp, bp, ax, 0);
+                pc = (unsigned char *) tmp[CoPc];
+                sp = (int *) tmp[CoSp];
+                bp = (int *) tmp[CoBp];
+                ax = tmp[CoAx];
+            }
+        } else if (op == PIPE) {
+            ax = guest_pipe((int *) *sp);
+        } else if (op == FCTL) {
+            ax = fcntl(sp[2], sp[1], sp[0]);
+        } else if (op == EPCR) {
+            ax = epoll_create1(0);
+        } else if (op == EPCT) {
+            ax = poll_ctl(sp[3], sp[2], sp[1], sp[0]);
+        } else if (op == EPWT) {  // epoll_wait(ep, events, max, timeout)
+            v = co && !parallel;  // park instead of blocking
+            ax = poll_wait(sp[3], (int *) sp[2], sp[1], v ? 0 : sp[0]);
+            if (ax < 0 && errno == EINTR && expired) {
+                return watchdog_stop(pc);
+            }
+            if (!ax && sp[0] && v && io_park(sp[3], EPOLLIN, sp[0])) {
+                tmp = co_switch(pc - 1, sp, bp, ax, 0);
+                pc = (unsigned char *) tmp[CoPc];
+                sp = (int *) tmp[CoSp];
+                bp = (int *) tmp[CoBp];
+                ax = tmp[CoAx];
+            }
         } else if (op == PRTF) {
-            tmp = sp + pc[1];
+            tmp = sp + (signed char) pc[1];  // operand of the ADJ after
             ax = printf((char *) tmp[-1], tmp[-2], tmp[-3], tmp[-4], tmp[-5],
                         tmp[-6]);
         } else if (op == MALC) {
-            ax = (int) malloc(*sp);
+            ax = alloc(*sp);
         } else if (op == MSET) {
             ax = (int) memset((char *) sp[2], sp[1], sp[0]);
         } else if (op == MCMP) {
             ax = memcmp((char *) sp[2], (char *) sp[1], sp[0]);
+        } else if (op == SNAP) {
+            ax = snapshot((char *) *sp, pc, sp, bp);
+        } else if ((op == SPWN || op == YLD || op == JOIN) && parallel) {
+            ax = -1;  // the coroutines are not the threads' to switch
+        } else if (op == SPWN) {  // spawn(f, arg)
+            ax = spawn(sp[1], sp[0]);
+        } else if (op == YLD) {  // yield(), let the ready coroutines run
+            if (co && io_parked) {
+                io_wait(0);
+            }
+            if (co && co_head >= 0) {
+                tmp = co_switch(pc, sp, bp, 0, 1);
+                pc = (unsigned char *) tmp[CoPc];
+                sp = (int *) tmp[CoSp];
+                bp = (int *) tmp[CoBp];
+                ax = tmp[CoAx];
+            } else {
+                ax = 0;
+            }
+        } else if (op == JOIN) {  // join(i), wait for coroutine i to return
+            v = *sp;
+            tmp = (co && v > 0 && v < CoMax && v != co_cur) ? co + v * CoSize
+                                                            : 0;
+            if (!tmp || tmp[CoState] == CoFree || tmp[CoJoin] >= 0) {
+                ax = -1;
+            } else if (tmp[CoState] == CoDone) {
+                ax = tmp[CoAx];
+                tmp[CoState] = CoFree;
+            } else {
+                tmp[CoJoin] = co_cur;
+                co[co_cur * CoSize + CoState] = CoWait;
+                if (!(tmp = co_switch(pc, sp, bp, 0, 0))) {
+                    printf("deadlock: no coroutine is ready to run\n");
+                    return -1;
+                }
+                pc = (unsigned char *) tmp[CoPc];
+                sp = (int *) tmp[CoSp];
+                bp = (int *) tmp[CoBp];
+                ax = tmp[CoAx];
+            }
+        } else if (op == STOP) {  // a function run by parallel_for returned,
+                                  // pf_call looks above its argument
+            sp[1] = 1;
+            return ax;
+        } else if (op == PFOR) {  // parallel_for(fn, lo, hi), which ends the
+                                  // program too if one of the calls did
+            if (parallel_for(sp[2], sp[1], sp[0], sp)) {
+                return pf_status;
+            }
+            ax = 0;
+        } else if (op == DONE) {  // a coroutine returned ax
+            tmp = co + co_cur * CoSize;
+            if (tmp[CoJoin] >= 0) {  // hand the result to the one waiting
+                co[tmp[CoJoin] * CoSize + CoState] = CoReady;
+                co[tmp[CoJoin] * CoSize + CoAx] = ax;
+                co_queue(tmp[CoJoin]);
+                tmp[CoState] = CoFree;
+            } else {
+                tmp[CoState] = CoDone;
+            }
+            if (!(tmp = co_switch(pc, sp, bp, ax, 0))) {
+                printf("deadlock: no coroutine is ready to run\n");
+                return -1;
+            }
+            pc = (unsigned char *) tmp[CoPc];
+            sp = (int *) tmp[CoSp];
+            bp = (int *) tmp[CoBp];
+            ax = tmp[CoAx];
         } else {
             printf("unknown instruction: %d\n", op);
             return -1;
@@ -1298,56 +5169,161 @@ int eval()
     return 0;
 }
 
-int main(int argc, char **argv)
+// open the counters of --perf-counters, those that are not available stay
+// closed and are reported as such
+void perf_open()
 {
-    int i, fd;
-    int *tmp;
-
-    argc--;
-    argv++;
-
-    pool_size = 256 * 1024;  // arbitrary size
-    line = 1;
+    struct perf_event_attr attr;
+    int i;
 
-    if ((fd = open(*argv, 0)) < 0) {
-        printf("could not open(%s)\n", *argv);
-        return -1;
+    i = 0;
+    while (i < PerfEvents) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = (i == PerfCycles)         ? PERF_COUNT_HW_CPU_CYCLES
+                      : (i == PerfInstructions) ? PERF_COUNT_HW_INSTRUCTIONS
+                      : (i == PerfBranchMisses) ? PERF_COUNT_HW_BRANCH_MISSES
+                                                : PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (perf_fd[i] < 0 && !perf_error) {
+            perf_error = errno;
+        }
+        i++;
     }
+}
 
-    // allocate memory for virtual machine
-    if (!(text = old_text = malloc(pool_size))) {
-        printf("could not malloc(%d) for text area\n", pool_size);
-        return -1;
+// start counting for `phase`, or stop and read the counters if not `start`
+void perf_phase(int phase, int start)
+{
+    unsigned long long v[3];  // value, time enabled and time running
+    struct timespec t;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if (start) {
+        perf_start = t.tv_sec * 1000000000LL + t.tv_nsec;
+    } else {
+        perf_count[phase][PerfEvents] =
+            t.tv_sec * 1000000000LL + t.tv_nsec - perf_start;
     }
-    if (!(data = malloc(pool_size))) {
-        printf("could not malloc(%d) for data area\n", pool_size);
-        return -1;
+    i = 0;
+    while (i < PerfEvents) {
+        if (perf_fd[i] < 0) {
+            // not available
+        } else if (start) {
+            ioctl(perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        } else {
+            ioctl(perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(perf_fd[i], v, sizeof(v)) == (int) sizeof(v) && v[2]) {
+                // scaled up if the counter had to share the hardware
+                perf_count[phase][i] = (long long) ((double) v[0] * v[1] / v[2]);
+            }
+        }
+        i++;
     }
-    if (!(stack = malloc(pool_size))) {
-        printf("could not malloc(%d) for data area\n", pool_size);
-        return -1;
+}
+
+void perf_report()
+{
+    char *name;
+    int i;
+
+    printf("%-16s %16s %16s\n", "perf counters", "compile", "execute");
+    printf("%-16s %16.3f %16.3f\n", "time (ms)",
+           perf_count[Compile][PerfEvents] / 1e6,
+           perf_count[Execute][PerfEvents] / 1e6);
+    i = 0;
+    while (i < PerfEvents) {
+        name = (i == PerfCycles)         ? "cycles"
+               : (i == PerfInstructions) ? "instructions"
+               : (i == PerfBranchMisses) ? "branch-misses"
+                                         : "cache-misses";
+        if (perf_fd[i] < 0) {
+            printf("%-16s %16s %16s\n", name, "n/a", "n/a");
+        } else {
+            printf("%-16s %16lld %16lld\n", name, perf_count[Compile][i],
+                   perf_count[Execute][i]);
+        }
+        i++;
     }
-    if (!(symbols = malloc(pool_size))) {
-        printf("could not malloc(%d) for symbol table\n", pool_size);
-        return -1;
+    if (perf_error) {
+        printf("some counters are not available: %s\n", strerror(perf_error));
     }
+}
+
+void usage()
+{
+    printf("usage: minicc [-O<n>] [-finline-limit=<words>] "
+           "[-finline-report] [-flazy] [-fir] [-j<threads>]\n"
+           "              [--perf-counters] [--max-instructions <n>]\n"
+           "              [--timeout <ms>] [--lex-bench] file ...\n"
+           "       minicc --restore <image>\n"
+           "       minicc --serve <socket>\n"
+           "       minicc --connect <socket> [options] file ...\n");
+}
+
+// lay the segments of the virtual machine out from `base`, the heap last
+void segments(char *base)
+{
+    text = old_text = (int *) base;
+    code = old_code = (unsigned char *) base + pool_size;
+    code_map = (int *) (base + 2 * pool_size);
+    data = old_data = base + 3 * pool_size;
+    stack = (int *) (base + 4 * pool_size);
+    buckets = (int *) (base + 5 * pool_size);
+    symbols = sym_top = buckets + Buckets;
+    old_src = base + 6 * pool_size;
+    ir_arena = (int *) (base + 7 * pool_size);
+    structs = (int *) (base + 8 * pool_size);
+    members = structs + (PTR - STRUCT) * StSize;
+    lines = (int *) (base + 9 * pool_size);
+    heap = base + 10 * pool_size;
+    heap_end = heap + heap_size;
+}
 
-    memset(text, 0, pool_size);
-    memset(data, 0, pool_size);
-    memset(stack, 0, pool_size);
-    memset(symbols, 0, pool_size);
+// allocate memory for the virtual machine and bootstrap the symbol table,
+// the warm state that the workers of a server are forked from.
+int setup()
+{
+    int i;
+    char *base;
 
-    // initial registers for virtual machine
-    sp = bp = (int *) ((char *) stack + pool_size);
-    ax = 0;
+    pool_size = 256 * 1024;  // arbitrary size
+    heap_size = 64 * 1024 * 1024;
 
-    src =
-        "char else enum if int return sizeof while "
-        "open read close printf malloc memset memcmp exit void main";
+    // allocate memory for virtual machine
+    // one zeroed mapping, so that a snapshot is a copy of a single range
+    base = mmap(0, 10 * pool_size + heap_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        printf("could not mmap(%d) for virtual machine\n",
+               10 * pool_size + heap_size);
+        return -1;
+    }
+    segments(base);
+    guard_stacks(PROT_NONE);
+
+    // the names are copied into the data segment, so that a snapshot
+    // restored by another process still has them
+    src = strcpy(
+        data,
+        "char else enum if int return sizeof while break case default switch "
+        "unsigned struct long "
+        "open read close printf malloc memset memcmp snapshot spawn yield join "
+        "write pipe fcntl epoll_create epoll_ctl epoll_wait parallel_for exit "
+        "void main");
+    data = data + strlen(data) + 1;
 
     // add keywords to symbol table
     i = Char;
-    while (i <= While) {
+    while (i <= Long) {
         next();
         current_id[Token] = i++;
     }
@@ -1368,34 +5344,514 @@ int main(int argc, char **argv)
     next();
     idmain = current_id;
 
-    if (!(src = old_src = malloc(pool_size))) {
-        printf("could not malloc(%d) for source area\n", pool_size);
+    return 0;
+}
+
+// slot `i` of the program cache
+int *cache_slot(int i)
+{
+    return (int *) ((char *) (cache + 2) +
+                    i * (CSlot * sizeof(int) + 3 * pool_size));
+}
+
+// take or release the lock of the program cache
+void cache_lock(int take)
+{
+    if (take) {
+        while (__sync_lock_test_and_set(cache, 1)) {
+            sched_yield();
+        }
+    } else {
+        __sync_lock_release(cache);
+    }
+}
+
+// look the program in the `len` bytes of source up in the cache. on a hit
+// its code and data are copied in, and the entry point is returned.
+unsigned char *cache_find(int len)
+{
+    int *slot, i;
+    char *p;
+    unsigned char *pc;
+
+    if (!cache || lazy || inline_report || watchdog) {
+        return 0;
+    }
+    cache_lock(1);
+    pc = 0;
+    i = 0;
+    while (i < cache_slots && !pc) {
+        slot = cache_slot(i);
+        p = (char *) (slot + CSlot);
+        if (slot[CSrc] == len && slot[COpt] == opt_level &&
+            slot[CInline] == inline_limit && slot[CIr] == opt_ir &&
+            !memcmp(p, old_src, len)) {
+            memcpy(old_code, p + pool_size, slot[CCode]);
+            code = old_code + slot[CCode];
+            memcpy(old_data, p + 2 * pool_size, slot[CData]);
+            data = old_data + slot[CData];
+            pc = old_code + slot[CEntry];
+        }
+        i++;
+    }
+    cache_lock(0);
+    return pc;
+}
+
+// add the program just compiled from `len` bytes of source, entered at
+// `pc`, to the cache, in place of the oldest one
+void cache_store(int len, unsigned char *pc)
+{
+    int *slot;
+    char *p;
+
+    if (!cache || lazy || inline_report || watchdog) {
+        return;
+    }
+    cache_lock(1);
+    slot = cache_slot(cache[1]);
+    cache[1] = (cache[1] + 1) % cache_slots;
+    p = (char *) (slot + CSlot);
+    slot[CSrc] = len;
+    slot[COpt] = opt_level;
+    slot[CInline] = inline_limit;
+    slot[CIr] = opt_ir;
+    slot[CCode] = code - old_code;
+    slot[CData] = data - old_data;
+    slot[CEntry] = pc - old_code;
+    memcpy(p, old_src, len);
+    memcpy(p + pool_size, old_code, slot[CCode]);
+    memcpy(p + 2 * pool_size, old_data, slot[CData]);
+    cache_lock(0);
+}
+
+// lex the `len` bytes of source over and over for a second, and report how
+// fast. the identifiers are entered in the symbol table by the first pass.
+int lex_benchmark(int len)
+{
+    struct timespec start, t;
+    long long ns, bytes, tokens;
+    char *strings;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bytes = tokens = ns = 0;
+    strings = data;
+    while (ns < 1000000000LL) {
+        src = old_src;
+        data = strings;  // string literals go there
+        line = 1;
+        next();
+        while (token > 0) {
+            tokens++;
+            next();
+        }
+        bytes = bytes + len;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        ns = (t.tv_sec - start.tv_sec) * 1000000000LL + t.tv_nsec -
+             start.tv_nsec;
+    }
+    printf("lexed %lld bytes, %lld tokens in %lld ms: %lld MB/s\n", bytes,
+           tokens, ns / 1000000, bytes * 1000 / ns);
+    return 0;
+}
+
+// compile the program in the file named by the first of `argv`, or in `fd`
+// if it is not -1, and run it with the rest. options come first.
+int run(int argc, char **argv, int fd)
+{
+    int i;
+    int *tmp, *sp;
+    unsigned char *pc;
+    struct itimerval timer;
+    struct sigaction sa;
+
+    opt_level = 1;
+    inline_limit = 48;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while (argc > 0 && **argv == '-') {
+        if ((*argv)[1] == 'O') {
+            opt_level = (*argv)[2] ? atoi(*argv + 2) : 1;
+        } else if ((*argv)[1] == 'j') {
+            threads = atoi(*argv + 2);
+        } else if (!strncmp(*argv, "-finline-limit=", 15)) {
+            inline_limit = atoi(*argv + 15);
+        } else if (!strcmp(*argv, "-finline-report")) {
+            inline_report = 1;
+        } else if (!strcmp(*argv, "-flazy")) {
+            lazy = 1;
+        } else if (!strcmp(*argv, "-fir")) {
+            opt_ir = 1;
+        } else if (!strcmp(*argv, "--perf-counters")) {
+            perf = 1;
+        } else if (!strcmp(*argv, "--lex-bench")) {
+            lex_bench = 1;
+        } else if (!strcmp(*argv, "--max-instructions") && argc > 1) {
+            argc--;
+            argv++;
+            budget = atoll(*argv);
+            watchdog = 1;
+        } else if (!strcmp(*argv, "--timeout") && argc > 1) {
+            argc--;
+            argv++;
+            timeout = atoi(*argv);
+            watchdog = 1;
+        } else {
+            printf("unknown option: %s\n", *argv);
+            return -1;
+        }
+        argc--;
+        argv++;
+    }
+    if (argc < 1) {
+        usage();
+        return -1;
+    }
+
+    line = 1;
+
+    if (fd < 0 && (fd = open(*argv, 0)) < 0) {
+        printf("could not open(%s)\n", *argv);
         return -1;
     }
 
     // read source code
+    src = old_src;
     if ((i = read(fd, src, pool_size - 1)) <= 0) {
         printf("read() returned %d\n", i);
         return -1;
     }
     src[i] = 0;  // set EOF character
     close(fd);
+    if (lex_bench) {
+        return lex_benchmark(i);
+    }
 
-    program();
+    if (perf) {
+        perf_open();
+        perf_phase(Compile, 1);
+    }
+    if (!(pc = cache_find(i))) {
+        // the code starts with where coroutines and the functions run by
+        // parallel_for return to, then the call of main and the exit with
+        // its result
+        *++text = DONE;
+        *++text = STOP;
+        *++text = CALL;
+        *++text = 0;  // main, once it is compiled
+        *++text = PUSH;
+        *++text = EXIT;
+
+        program();
+
+        if (!idmain[Value]) {
+            printf("main() not defined\n");
+            return -1;
+        }
 
-    if (!(pc = (int *) idmain[Value])) {
-        printf("main() not defined\n");
-        return -1;
+        old_text[4] = idmain[Value];
+        assemble(old_text + 1, text + 1);
+        pc = old_code + 2;
+        cache_store(i, pc);
     }
+    if (perf) {
+        perf_phase(Compile, 0);
+    }
+
+    // copy the arguments to the heap, where snapshots keep them
+    tmp = (int *) alloc((argc + 1) * sizeof(int));
+    i = 0;
+    while (i < argc) {
+        tmp[i] = alloc(strlen(argv[i]) + 1);
+        strcpy((char *) tmp[i], argv[i]);
+        i++;
+    }
+    tmp[argc] = 0;
 
     // setup stack
     sp = (int *) ((int) stack + pool_size);
-    *--sp = EXIT;  // call exit if main returns
-    *--sp = PUSH;  // put exit code to stack from ax
-    tmp = sp;
     *--sp = argc;
-    *--sp = (int) argv;
-    *--sp = (int) tmp;  // set returen address of main
+    *--sp = (int) tmp;
+
+    if (timeout > 0) {
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_sec = timeout / 1000;
+        timer.it_value.tv_usec = timeout % 1000 * 1000;
+        // without SA_RESTART, so that a blocking syscall returns EINTR
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = watchdog_alarm;
+        sigaction(SIGALRM, &sa, 0);
+        setitimer(ITIMER_REAL, &timer, 0);
+    }
+
+    if (!perf) {
+        return eval(pc, sp, sp, 0);
+    }
+    // functions compiled lazily count as executing
+    perf_phase(Execute, 1);
+    i = eval(pc, sp, sp, 0);
+    perf_phase(Execute, 0);
+    perf_report();
+    return i;
+}
+
+// handle one request on the listening socket `s`: the client's standard
+// streams, source file and arguments come over the connection, and the exit
+// status of the program goes back.
+int worker(int s)
+{
+    int c, n, i, argc, status;
+    int fds[4];
+    char buf[4096], cbuf[CMSG_SPACE(sizeof(fds))];
+    char **argv;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+
+    if ((c = accept(s, 0, 0)) < 0) {
+        return -1;
+    }
+    close(s);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf) - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if ((n = recvmsg(c, &msg, 0)) <= 0 || !(cm = CMSG_FIRSTHDR(&msg)) ||
+        cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    i = 0;
+    while (i < 3) {
+        dup2(fds[i], i);
+        close(fds[i]);
+        i++;
+    }
+
+    // the arguments, each followed by a NUL
+    buf[n] = 0;
+    argv = malloc((n + 1) * sizeof(char *));
+    argc = 0;
+    i = 0;
+    while (i < n) {
+        argv[argc++] = buf + i;
+        i = i + strlen(buf + i) + 1;
+    }
+    argv[argc] = 0;
+
+    status = run(argc, argv, fds[3]);
+    fflush(stdout);
+    write(c, &status, sizeof(status));
+    return status;
+}
+
+// serve requests on the Unix socket `path`. each runs in a worker forked
+// from the warm state, and a few workers wait for requests at any time.
+int serve(char *path)
+{
+    int s, live, workers, pid;
+    struct sockaddr_un addr;
+
+    if (setup() < 0) {
+        return -1;
+    }
+
+    workers = 4;
+    cache_slots = 16;
+    cache = mmap(0, 2 * sizeof(int) + cache_slots * (CSlot * sizeof(int) +
+                                                     3 * pool_size),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        printf("could not mmap() the program cache\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(s, 64) < 0) {
+        printf("could not listen on %s\n", path);
+        return -1;
+    }
+    fflush(stdout);
+
+    live = 0;
+    while (1) {
+        if (live < workers) {
+            if (!(pid = fork())) {
+                exit(worker(s));
+            }
+            if (pid < 0) {
+                printf("could not fork() a worker\n");
+                return -1;
+            }
+            live++;
+        } else if (wait(0) > 0) {
+            live--;
+        }
+    }
+    return 0;
+}
+
+// run a program on the server listening on `path`: pass it our standard
+// streams, the source file and the arguments, and return its exit status.
+int client(char *path, int argc, char **argv)
+{
+    int s, n, i, status;
+    int fds[4];
+    char buf[4096], cbuf[CMSG_SPACE(sizeof(fds))];
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+
+    // the source file is the first argument after the options
+    i = 0;
+    while (i < argc && *argv[i] == '-') {
+        i++;
+    }
+    if (i == argc) {
+        usage();
+        return -1;
+    }
+    if ((fds[3] = open(argv[i], 0)) < 0) {
+        printf("could not open(%s)\n", argv[i]);
+        return -1;
+    }
+    fds[0] = 0;
+    fds[1] = 1;
+    fds[2] = 2;
+
+    n = 0;
+    i = 0;
+    while (i < argc) {
+        if (n + strlen(argv[i]) + 1 > sizeof(buf) - 1) {
+            printf("arguments too long\n");
+            return -1;
+        }
+        strcpy(buf + n, argv[i]);
+        n = n + strlen(argv[i]) + 1;
+        i++;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        printf("could not connect to %s\n", path);
+        return -1;
+    }
 
-    return eval();
-}
\ No newline at end of file
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = n;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (sendmsg(s, &msg, 0) < 0) {
+        printf("could not send the request to %s\n", path);
+        return -1;
+    }
+
+    // the worker exits without a status on compile errors
+    if (read(s, &status, sizeof(status)) != sizeof(status)) {
+        return -1;
+    }
+    return status;
+}
+
+// resume the program saved in the image `path` where it took the snapshot
+int restore(char *path)
+{
+    int fd, size;
+    int hdr[SHeader];
+    char *base;
+
+    if ((fd = open(path, 0)) < 0) {
+        printf("could not open(%s)\n", path);
+        return -1;
+    }
+    if (read(fd, hdr, sizeof(hdr)) != (int) sizeof(hdr) ||
+        hdr[SMagic] != 0x6363696d) {
+        printf("%s is not a snapshot image\n", path);
+        return -1;
+    }
+    pool_size = hdr[SPool];
+    heap_size = hdr[SHeapSize];
+    size = 10 * pool_size + heap_size;
+
+    // the image holds absolute addresses, so it goes back to where it was,
+    // and the rest of the heap follows it
+    base = (char *) hdr[SBase];
+    if (mmap(base, hdr[SSize], PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, hdr[SOffset]) != base ||
+        mmap(base + hdr[SSize], size - hdr[SSize], PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1,
+             0) != base + hdr[SSize]) {
+        printf("could not mmap() %s at %p\n", path, base);
+        return -1;
+    }
+    close(fd);
+
+    segments(base);
+    text = (int *) hdr[SText];
+    sym_top = (int *) hdr[SSymbols];
+    code = (unsigned char *) hdr[SCode];
+    data = (char *) hdr[SData];
+    heap = (char *) hdr[SHeap];
+    opt_level = hdr[SOpt];
+    inline_limit = hdr[SInline];
+    lazy = hdr[SLazy];
+    opt_ir = hdr[SIr];
+    idmain = (int *) hdr[SMain];
+    co = (int *) hdr[SCo];
+    co_cur = hdr[SCoCur];
+    co_head = hdr[SCoHead];
+    co_tail = hdr[SCoTail];
+    guard_stacks(PROT_NONE);
+
+    return eval((unsigned char *) hdr[SPc], (int *) hdr[SSp],
+                (int *) hdr[SBp], hdr[SAx]);
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa;
+
+    argc--;
+    argv++;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = stack_overflow;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &sa, 0);
+    page_size = sysconf(_SC_PAGESIZE);
+    init_lexer();
+
+    if (argc == 2 && !strcmp(*argv, "--serve")) {
+        return serve(argv[1]);
+    }
+    if (argc == 2 && !strcmp(*argv, "--restore")) {
+        return restore(argv[1]);
+    }
+    if (argc >= 2 && !strcmp(*argv, "--connect")) {
+        return client(argv[1], argc - 2, argv + 2);
+    }
+    if (setup() < 0) {
+        return -1;
+    }
+    return run(argc, argv, -1);
+}